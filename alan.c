@@ -1,4 +1,6 @@
 #define _CRT_SECURE_NO_WARNINGS 1
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE 1
 #if defined(_MSC_VER)  // Check if we are using a windows compiler
 #define strtok_r strtok_s
 #endif
@@ -11,14 +13,39 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define BATCH_AVX2 1
+#include <immintrin.h>
+#endif
 
 #include "alan.h"
 
 #define TAPE_LENGTH 4096
 #define MAX_BRANCH_COUNT 32
 #define MAX_OPERATION_COUNT 16
-#define MAX_CONF_COUNT 32
-#define MAX_LINE_COUNT 256
+#define MAX_CONF_COUNT 256
+#define MAX_FUNCTION_COUNT 32
+#define MAX_PARAM_COUNT 8
+#define MAX_LINE_COUNT 4096
 #define MAX_ERROR 8
 
 #define NONE ' '
@@ -28,6 +55,45 @@
 
 #define WINDOWSIZE 10
 
+#define DEFAULT_BLOCK_SIZE 8
+#define MAX_BLOCK_SIZE 32
+#define MACRO_CACHE_SIZE 4096  // Must be a power of two
+#define MAX_MACRO_STEPS 65536
+
+#define PERF_COUNTER_COUNT 5
+
+#define OUTPUT_CHUNK_SIZE (1 << 16)
+
+#define MAX_BREAKPOINT_COUNT 16
+
+#define TAPE_PAGE_SIZE 256
+#define TAPE_PAGE_COUNT (TAPE_LENGTH / TAPE_PAGE_SIZE)
+#define CHECKPOINT_INTERVAL 65536
+
+#define WATCH_WINDOW 64
+#define WATCH_FPS 30
+#define WATCH_PUBLISH_INTERVAL 1024
+
+#define BATCH_WIDTH 8  // Lanes in an AVX2 register
+#define BATCH_WIDTH_SHIFT 3
+#define BATCH_TRIAL_PASSES 4096
+
+#define MAX_STAGE_COUNT 16
+#define RING_BUFFER_SIZE 1024
+#ifndef O_BINARY
+#define O_BINARY 0  // Only needed on windows, to avoid newline translation
+#endif
+
+#define RELOAD_POLL_INTERVAL 65536  // Must be a power of two
+#define RELOAD_POLL_SECONDS 0.25
+
+#define DEFAULT_FUZZ_PROGRAMS 1000
+#define DEFAULT_FUZZ_PASSES 1000
+#define MAX_FUZZ_CONFIGS 8
+#define MAX_FUZZ_BRANCHES 12
+#define MAX_FUZZ_OPS 4
+#define MAX_FUZZ_OP_LENGTH 8
+
 #define ARGUMENT_ERROR -1
 #define FILE_ERROR -2
 #define NOLINE -1
@@ -65,11 +131,82 @@ typedef struct Configuration {
 
 typedef struct Machine {
     int pointer;
+    int configuration;
+    int topPointerAccessed;  // Value used for determining how much to print
+
+    // Hash of the tape, kept up to date by write_cell while 'hashing' is set
+    bool hashing;
+    uint64_t tapeHash;
     char tape[TAPE_LENGTH];
 
+    // Log that write_cell saves overwritten cells to, if recording
+    UndoLog *undo;
+
     Configuration configurations[MAX_CONF_COUNT];
 } Machine;
 
+// One entry in the undo log for every pass. Together with the cells
+// that were overwritten during the pass, it is enough to undo the pass.
+typedef struct UndoStep {
+    int32_t pointerDelta;
+    int32_t topDelta;
+    uint32_t writeCount;
+    uint16_t configuration;  // Configuration before the pass
+    uint8_t branch;          // Index of the branch that was taken
+} UndoStep;
+
+typedef struct UndoWrite {
+    uint16_t cell;
+    char previous;
+} UndoWrite;
+
+// Checkpoints share the pages of the tape that did not change between them
+typedef struct TapePage {
+    int references;
+    char cells[TAPE_PAGE_SIZE];
+} TapePage;
+
+typedef struct Checkpoint {
+    int pass;
+    size_t writeCount;  // Length of the write log at this pass
+    int pointer;
+    int configuration;
+    int topPointerAccessed;
+    TapePage *pages[TAPE_PAGE_COUNT];
+} Checkpoint;
+
+typedef struct UndoLog {
+    int interval;  // Passes between checkpoints
+
+    UndoStep *steps;  // steps[n] undoes pass n + 1
+    int stepCount;
+    int stepCapacity;
+    UndoWrite *writes;
+    size_t writeCount;
+    size_t writeCapacity;
+
+    Checkpoint *checkpoints;
+    int checkpointCount;
+    int checkpointCapacity;
+    bool dirty[TAPE_PAGE_COUNT];  // Pages written since the last checkpoint
+} UndoLog;
+
+typedef struct MacroTransition {
+    bool valid;
+
+    // The situation in which the transition applies
+    int configuration;
+    int entry;  // Offset of the head within the block
+    char block[MAX_BLOCK_SIZE];
+
+    // What the block looks like once the head has left it
+    int nextConfiguration;
+    int exit;  // Offset of the head relative to the start of the block
+    int top;   // Highest head offset seen after a pass
+    int steps;
+    char result[MAX_BLOCK_SIZE];
+} MacroTransition;
+
 /*
  * Here we define structures used for the intermediary representation
  * of the turing program, which helps us detect errors at parse-time,
@@ -88,6 +225,7 @@ typedef struct IBranch {
     int definedOn;
     char *matchSymbol;
     IConfig *next;
+    char *nextName;  // Only used by m-functions, which are bound later
     int opCount;
     char *opsString;
     IOperation ops[MAX_OPERATION_COUNT];
@@ -99,11 +237,19 @@ typedef struct IConfig {
     char *name;
     int branchCount;
     IBranch branches[MAX_BRANCH_COUNT];
+
+    // Parameters of m-functions, like 'C', 'B' and 'A' in 'f(C, B, A)'
+    bool isFunction;
+    int paramCount;
+    char *params[MAX_PARAM_COUNT];
 } IConfig;
 
 typedef struct IR {
     int configCount;
     IConfig configs[MAX_CONF_COUNT];
+
+    int functionCount;
+    IConfig functions[MAX_FUNCTION_COUNT];
 } IR;
 
 typedef enum ErrorType { Err, Warn } ErrorType;
@@ -115,65 +261,40 @@ typedef struct Error {
 } Error;
 
 typedef struct Context {
-    IR parseInfo;
+    IR *parseInfo;
 
     bool errorOverflow;
     int nextError;
     Error errors[MAX_ERROR];
 } Context;
 
+// Removes leading and trailing whitespace in place. The string is
+// shifted to the start, so that the returned pointer can still be freed.
 char *trim(char *str) {
-    // TODO Write a simpler version of this
-    // https://stackoverflow.com/questions/122616/how-do-i-trim-leading-trailing-whitespace-in-a-standard-way
-    size_t len = 0;
-    char *frontp = str;
-    char *endp = NULL;
-
     if (str == NULL) {
         return NULL;
     }
-    if (str[0] == '\0') {
-        return str;
-    }
 
-    len = strlen(str);
-    endp = str + len;
-
-    /* Move the front and back pointers to address the first non-whitespace
-     * characters from each end.
-     */
-    while (isspace((unsigned char)*frontp)) {
-        ++frontp;
-    }
-    if (endp != frontp) {
-        while (isspace((unsigned char)*(--endp)) && endp != frontp) {
-        }
+    char *front = str;
+    while (isspace((unsigned char)*front)) {
+        ++front;
     }
-
-    if (frontp != str && endp == frontp)
-        *str = '\0';
-    else if (str + len - 1 != endp)
-        *(endp + 1) = '\0';
-
-    /* Shift the string so that it starts at str so that if it's dynamically
-     * allocated, we can still free it on the returned pointer.  Note the reuse
-     * of endp to mean the front of the string buffer now.
-     */
-    endp = str;
-    if (frontp != str) {
-        while (*frontp) {
-            *endp++ = *frontp++;
-        }
-        *endp = '\0';
+    size_t length = strlen(front);
+    while (length > 0 && isspace((unsigned char)front[length - 1])) {
+        --length;
     }
 
+    memmove(str, front, length);
+    str[length] = '\0';
     return str;
 }
 
 void parse_error(Context *c, char *msg, int line) {
     if (c->nextError < MAX_ERROR) {
         // TODO bound check and assert
-        c->errors[c->nextError].message = msg;
+        char *copy = (char *)malloc(strlen(msg) + 1);
+        strcpy(copy, msg);
+        c->errors[c->nextError].message = copy;
         c->errors[c->nextError].line = line;
         c->errors[c->nextError].type = Err;
         c->nextError++;
@@ -185,7 +306,11 @@ void parse_error(Context *c, char *msg, int line) {
 void error(Context *c, char *msg, int line) {
     if (c->nextError < MAX_ERROR) {
         // TODO bound check and assert
-        c->errors[c->nextError].message = msg;
+        // Errors are usually formatted into a stack buffer,
+        // so we keep our own copy of the message.
+        char *copy = (char *)malloc(strlen(msg) + 1);
+        strcpy(copy, msg);
+        c->errors[c->nextError].message = copy;
         c->errors[c->nextError].line = line;
         c->errors[c->nextError].type = Err;
         c->nextError++;
@@ -206,8 +331,10 @@ void warning(Context *c, char *msg, int line) {
     }
 }
 
-void handle_errors(Context *c) {
-    bool fatal;
+// Prints the errors and warnings in the context. Returns true if any
+// of them were errors.
+bool print_errors(Context *c) {
+    bool fatal = false;
     for (int i = 0; i < c->nextError; i++) {
         int line = c->errors[i].line;
         char *msg = c->errors[i].message;
@@ -224,7 +351,11 @@ void handle_errors(Context *c) {
             fatal = true;
         }
     }
-    if (fatal) {
+    return fatal;
+}
+
+void handle_errors(Context *c) {
+    if (print_errors(c)) {
         exit(EXIT_FAILURE);
     }
 }
@@ -282,6 +413,7 @@ char *parse_string(char *result, char *binary) {
         }
         result[resultIndex++] = sum;
     }
+    result[resultIndex] = '\0';
     return result;
 }
 
@@ -331,6 +463,20 @@ int split_on(char *slots[], char *text, char *delimiter) {
     return index;
 }
 
+// Splits the text into lines, keeping empty lines so that the
+// line numbers match the source.
+int split_lines(char *lines[], char *text) {
+    int index = 0;
+    lines[index++] = text;
+    for (char *c = text; *c != '\0' && index < MAX_LINE_COUNT; c++) {
+        if (*c == '\n') {
+            *c = '\0';
+            lines[index++] = c + 1;
+        }
+    }
+    return index;
+}
+
 bool find_in_string(char *string, char symbol) {
     char *c;
     for (c = string; *c != '\0'; c++) {
@@ -364,9 +510,258 @@ bool legal_config_name(char *string) {
     return true;
 }
 
-IR *parse(Context *c, IR *ir, char *code) {
+bool legal_param_name(char *string) {
+    if (is_empty(string)) {
+        return false;
+    }
+    char *c;
+    for (c = string; *c != '\0'; c++) {
+        if (!isupper((int)*c)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Here we handle m-functions, which are configurations that take
+ * parameters, like 'f(C, B, A)' in Annotated Turing. The definitions
+ * are kept aside as templates, and every call that is referenced from
+ * the program, like 'f(new, done, x)', is expanded into a plain
+ * configuration named after the call. Since the call is used as the
+ * name, each instantiation is only generated once.
+ */
+
+// Splits a call like 'f(a, g(b, c))' into its name and its top-level
+// arguments. The text is modified in place. Returns the number of
+// arguments, or -1 if the call is malformed.
+int split_call(char *text, char **name, char *args[MAX_PARAM_COUNT]) {
+    char *open = strchr(text, '(');
+    char *close = strrchr(text, ')');
+    if (open == NULL || close == NULL || close < open || *trim(close + 1) != '\0') {
+        return -1;
+    }
+    *open = '\0';
+    *close = '\0';
+    *name = trim(text);
+
+    int argCount = 0;
+    int depth = 0;
+    char *arg = open + 1;
+    for (char *c = open + 1;; c++) {
+        if (*c == '(') {
+            depth++;
+        } else if (*c == ')') {
+            depth--;
+        } else if ((*c == ',' && depth == 0) || *c == '\0') {
+            bool last = *c == '\0';
+            *c = '\0';
+            if (argCount == MAX_PARAM_COUNT) {
+                return -1;
+            }
+            args[argCount++] = trim(arg);
+            arg = c + 1;
+            if (last) {
+                break;
+            }
+        }
+        if (depth < 0) {
+            return -1;
+        }
+    }
+    if (depth != 0) {
+        return -1;
+    }
+    if (argCount == 1 && is_empty(args[0])) {
+        return 0;
+    }
+    return argCount;
+}
+
+// Substitutes the parameters of 'function' in a configuration name
+// with the given arguments, and writes calls in a canonical form, so
+// that the same instantiation always gets the same name. 'function'
+// may be NULL, in which case the name is only normalized.
+char *bind_name(Context *c, char *text, IConfig *function, char **args,
+        int line) {
+    if (function != NULL) {
+        for (int pi = 0; pi < function->paramCount; pi++) {
+            if (strcmp(text, function->params[pi]) == 0) {
+                return args[pi];
+            }
+        }
+    }
+    if (!find_in_string(text, '(')) {
+        return text;
+    }
+
+    char *copy = (char *)malloc(strlen(text) + 1);
+    strcpy(copy, text);
+    char *name;
+    char *callArgs[MAX_PARAM_COUNT];
+    int argCount = split_call(copy, &name, callArgs);
+    if (argCount == -1) {
+        char buffer[256];
+        snprintf(buffer, sizeof(buffer), "malformed m-function call '%s'", text);
+        parse_error(c, buffer, line);
+        return text;
+    }
+
+    size_t length = strlen(name) + 3;
+    for (int ai = 0; ai < argCount; ai++) {
+        callArgs[ai] = bind_name(c, callArgs[ai], function, args, line);
+        length += strlen(callArgs[ai]) + 2;
+    }
+    char *bound = (char *)malloc(length);
+    strcpy(bound, name);
+    strcat(bound, "(");
+    for (int ai = 0; ai < argCount; ai++) {
+        if (ai > 0) {
+            strcat(bound, ", ");
+        }
+        strcat(bound, callArgs[ai]);
+    }
+    strcat(bound, ")");
+    free(copy);
+    return bound;
+}
+
+// Looks up the configuration with the given name, inserting it as not
+// yet defined if it has not been seen before.
+int reference_config(Context *c, IR *ir, char *name, int line) {
+    int index = find_config(ir->configs, name);
+    if (index != NOT_DEFINED) {
+        return index;
+    }
+    if (ir->configs[MAX_CONF_COUNT - 1].name != NULL) {
+        parse_error(c, "too many configurations (does an m-function expand endlessly?)",
+                line);
+        return MAX_CONF_COUNT - 1;
+    }
+    index = insert_config(ir->configs, name);
+    ir->configs[index].definedOn = line;
+    return index;
+}
+
+IConfig *define_function(Context *c, IR *ir, char *header, int line) {
+    char *name;
+    char *params[MAX_PARAM_COUNT];
+    int paramCount = split_call(header, &name, params);
+    if (paramCount == -1) {
+        parse_error(c, "malformed m-function definition (declare like 'f(C, B, A): ...')",
+                line);
+        return NULL;
+    }
+    if (!legal_config_name(name)) {
+        parse_error(c, "m-function name must be all lower case", line);
+    }
+    for (int pi = 0; pi < paramCount; pi++) {
+        if (!legal_param_name(params[pi])) {
+            parse_error(c, "m-function parameters must be all upper case", line);
+        }
+        for (int pj = 0; pj < pi; pj++) {
+            if (strcmp(params[pi], params[pj]) == 0) {
+                parse_error(c, "m-function parameter is declared twice", line);
+            }
+        }
+    }
+    for (int fi = 0; fi < ir->functionCount; fi++) {
+        if (strcmp(ir->functions[fi].name, name) == 0) {
+            parse_error(c, "redefinition of m-function", line);
+            return NULL;
+        }
+    }
+    if (ir->functionCount == MAX_FUNCTION_COUNT) {
+        parse_error(c, "too many m-functions", line);
+        return NULL;
+    }
+
+    IConfig *function = &ir->functions[ir->functionCount++];
+    function->name = name;
+    function->definedOn = line;
+    function->defined = true;
+    function->isFunction = true;
+    function->paramCount = paramCount;
+    for (int pi = 0; pi < paramCount; pi++) {
+        function->params[pi] = params[pi];
+    }
+    return function;
+}
+
+// Fills in the configuration at 'index', whose name is a call to an
+// m-function, by copying the branches of the m-function and binding
+// its parameters to the arguments of the call.
+void instantiate_function(Context *c, IR *ir, int index) {
+    IConfig *conf = &ir->configs[index];
+
+    char *copy = (char *)malloc(strlen(conf->name) + 1);
+    strcpy(copy, conf->name);
+    char *name;
+    char *args[MAX_PARAM_COUNT];
+    int argCount = split_call(copy, &name, args);
+
+    IConfig *function = NULL;
+    for (int fi = 0; fi < ir->functionCount; fi++) {
+        if (strcmp(ir->functions[fi].name, name) == 0) {
+            function = &ir->functions[fi];
+        }
+    }
+    if (function == NULL) {
+        char buffer[256];
+        snprintf(buffer, sizeof(buffer), "m-function '%s' was referenced but not defined", name);
+        parse_error(c, buffer, conf->definedOn);
+        return;
+    }
+    if (argCount != function->paramCount) {
+        char buffer[256];
+        snprintf(buffer, sizeof(buffer), "m-function '%s' takes %i arguments, but was given %i",
+                name, function->paramCount, argCount);
+        parse_error(c, buffer, conf->definedOn);
+        return;
+    }
+
+    ir->configCount += 1;
+    conf->defined = true;
+    conf->definedOn = function->definedOn;
+    conf->branchCount = function->branchCount;
+
+    for (int bi = 0; bi < function->branchCount; bi++) {
+        IBranch *template = &function->branches[bi];
+        IBranch *branch = &conf->branches[bi];
+        *branch = *template;
+
+        // Parameters can stand in for match symbols and printed symbols
+        for (int pi = 0; pi < function->paramCount; pi++) {
+            if (strcmp(template->matchSymbol, function->params[pi]) == 0) {
+                branch->matchSymbol = args[pi];
+                if (strlen(args[pi]) > 1 && strcmp(args[pi], "none") != 0 &&
+                        strcmp(args[pi], "any") != 0 &&
+                        strcmp(args[pi], "else") != 0) {
+                    parse_error(c, "argument used as a match symbol must be a single symbol",
+                            template->definedOn);
+                }
+            }
+            for (int oi = 0; oi < template->opCount; oi++) {
+                if (template->ops[oi].name == 'P' &&
+                        strcmp(template->ops[oi].string, function->params[pi]) == 0) {
+                    branch->ops[oi].string = args[pi];
+                }
+            }
+        }
+
+        if (template->nextName != NULL) {
+            char *next = bind_name(c, template->nextName, function, args,
+                    template->definedOn);
+            branch->next = &ir->configs[reference_config(c, ir, next,
+                    template->definedOn)];
+        }
+    }
+}
+
+// Parses the program into 'ir'. Errors are collected in the context,
+// and it is up to the caller to handle them.
+void parse_program(Context *c, IR *ir, char *code) {
     // Definer delimitere
-    char newline[] = "\n";
     char commentDelim[] = "!";
     char configNameDelim[] = ":";
     char branchDelim[] = ";";
@@ -374,7 +769,7 @@ IR *parse(Context *c, IR *ir, char *code) {
     char operationDelim[] = ",";
 
     char *lines[MAX_LINE_COUNT] = {0};
-    int lineCount = split_on(lines, code, newline);
+    int lineCount = split_lines(lines, code);
     IConfig *conf = NULL;
 
     int branchIndex = 0;
@@ -393,7 +788,6 @@ IR *parse(Context *c, IR *ir, char *code) {
         // configuration. If it is, create the new configuration in the
         // machine struct and change 'c' to refer to it.
         if (find_in_string(lineContext, ':')) {
-            ir->configCount += 1;
             char *name = strtok_r(NULL, configNameDelim, &lineContext);
             name = trim(name);
             if (is_empty(lineContext) && !name) {
@@ -401,29 +795,39 @@ IR *parse(Context *c, IR *ir, char *code) {
                 lineContext = name;
             };
 
-            if (!legal_config_name(name)) {
-                parse_error(c, "configuration name must be all lower case",
-                        currentLine);
-            }
+            // Definitions with parameters are m-functions, whose
+            // branches are kept aside until they are called.
+            if (find_in_string(name, '(')) {
+                conf = define_function(c, ir, name, currentLine);
+                if (conf == NULL) {
+                    continue;
+                }
+            } else {
+                ir->configCount += 1;
+                if (!legal_config_name(name)) {
+                    parse_error(c, "configuration name must be all lower case",
+                            currentLine);
+                }
 
-            int prevIndex = find_config(ir->configs, name);
-            if (ir->configs[prevIndex].defined) {
-                parse_error(c, "redefinition of configuration", currentLine);
-            }
+                int prevIndex = find_config(ir->configs, name);
+                if (prevIndex != NOT_DEFINED && ir->configs[prevIndex].defined) {
+                    parse_error(c, "redefinition of configuration", currentLine);
+                }
 
-            int configIndex = insert_config(ir->configs, name);
+                int configIndex = insert_config(ir->configs, name);
 
-            // We have found a n actual declaration of the
-            // configuration, so we set it to defined.
-            // This does not mean that the definition
-            // is valid, only that it is not referenced
-            // by a different configuration without
-            // being defined.
-            ir->configs[configIndex].defined = true;
-            conf = &ir->configs[configIndex];
+                // We have found a n actual declaration of the
+                // configuration, so we set it to defined.
+                // This does not mean that the definition
+                // is valid, only that it is not referenced
+                // by a different configuration without
+                // being defined.
+                ir->configs[configIndex].defined = true;
+                conf = &ir->configs[configIndex];
 
-            conf->name = name;
-            conf->definedOn = currentLine;
+                conf->name = name;
+                conf->definedOn = currentLine;
+            }
 
             // Reset branch index since we are in a new configuration
             branchIndex = 0;
@@ -535,16 +939,24 @@ IR *parse(Context *c, IR *ir, char *code) {
             hasNext = false;
         };
 
-        if (hasNext) {
-            int nextConfigIndex = find_config(ir->configs, nextName);
-            if (nextConfigIndex == NOT_DEFINED) {
-                nextConfigIndex = insert_config(ir->configs, nextName);
-                ir->configs[nextConfigIndex].definedOn = currentLine;
-            }
-
+        if (hasNext && conf->isFunction) {
+            branch->nextName = nextName;
+        } else if (hasNext) {
+            nextName = bind_name(c, nextName, NULL, NULL, currentLine);
+            int nextConfigIndex = reference_config(c, ir, nextName, currentLine);
             branch->next = &ir->configs[nextConfigIndex];
         }
     }
+
+    // Expand the m-function calls that have been referenced. New calls
+    // referenced by the expansions are appended to the table, so they
+    // are picked up by this same loop.
+    for (int ci = 0; ci < MAX_CONF_COUNT && ir->configs[ci].name != NULL; ci++) {
+        IConfig *config = &ir->configs[ci];
+        if (!config->defined && find_in_string(config->name, '(')) {
+            instantiate_function(c, ir, ci);
+        }
+    }
     // Iterate over branches of configs and check that their
     // 'next' function is defined.
     /* TODO TODO TODO
@@ -576,8 +988,12 @@ IR *parse(Context *c, IR *ir, char *code) {
         }
     }
 
+}
+
+IR *parse(Context *c, IR *ir, char *code) {
+    parse_program(c, ir, code);
     handle_errors(c);
-    c->parseInfo = *ir;
+    c->parseInfo = ir;
     return ir;
 }
 
@@ -590,21 +1006,78 @@ void left(Machine *m, int count) {
     // TODO Assert that we don't go outside tape bounds
     m->pointer -= count;
 }
+// splitmix64 finalizer
+uint64_t mix_hash(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+// The tape hash is the xor of the hashes of all its cells. Blank cells
+// hash to zero, so a blank tape has a hash of zero.
+uint64_t cell_hash(int cell, char symbol) {
+    if (symbol == NONE) {
+        return 0;
+    }
+    return mix_hash(((uint64_t)cell << 8) | (unsigned char)symbol);
+}
+
+void record_write(UndoLog *undo, int cell, char previous) {
+    if (undo->writeCount == undo->writeCapacity) {
+        undo->writeCapacity = undo->writeCapacity ? 2 * undo->writeCapacity : 4096;
+        undo->writes = (UndoWrite *)realloc(undo->writes,
+                undo->writeCapacity * sizeof(UndoWrite));
+    }
+    UndoWrite *write = &undo->writes[undo->writeCount++];
+    write->cell = (uint16_t)cell;
+    write->previous = previous;
+    undo->dirty[cell / TAPE_PAGE_SIZE] = true;
+}
+
+// Writes a symbol to the cell under the head. Writes that fall outside
+// of the tape are dropped, and the next pass will report the head as
+// being outside of the tape.
+void write_cell(Machine *m, char symbol) {
+    if (m->pointer < 0 || m->pointer >= TAPE_LENGTH) {
+        return;
+    }
+    if (m->hashing) {
+        m->tapeHash ^= cell_hash(m->pointer, m->tape[m->pointer]) ^
+            cell_hash(m->pointer, symbol);
+    }
+    if (m->undo != NULL) {
+        record_write(m->undo, m->pointer, m->tape[m->pointer]);
+    }
+    m->tape[m->pointer] = symbol;
+}
+
 void print(Machine *m, char *sym) {
     assert(sym != NULL);
     if (strlen(sym) > 1) {
         while (*sym != '\0') {
-            m->tape[m->pointer] = *sym++;
+            write_cell(m, *sym++);
             right(m, 2);
         }
     } else {
-        m->tape[m->pointer] = *sym;
+        write_cell(m, *sym);
     }
 }
 
-void erase(Machine *m) { m->tape[m->pointer] = ' '; }
+void erase(Machine *m) { write_cell(m, NONE); }
 
-char read(Machine *m) { return m->tape[m->pointer]; }
+bool head_on_tape(Context *context, Machine *m) {
+    if (m->pointer >= 0 && m->pointer < TAPE_LENGTH) {
+        return true;
+    }
+    IConfig *info = m->configurations[m->configuration].info;
+    char buffer[256];
+    sprintf(buffer, "The head moved outside of the tape (to cell %i) before configuration '%s'",
+            m->pointer, info->name);
+    error(context, buffer, info->definedOn);
+    return false;
+}
+
+char read_symbol(Machine *m) { return m->tape[m->pointer]; }
 
 void copy_n(size_t SourceACount, char *SourceA, size_t DestCount, char *Dest) {
     for (int Index = 0; Index < SourceACount; ++Index) {
@@ -616,14 +1089,9 @@ void copy_n(size_t SourceACount, char *SourceA, size_t DestCount, char *Dest) {
 void print_machine(int passCount, IConfig *configInfo, IBranch *branchInfo,
         Machine *m, int topPointerAccessed, int lowerBound,
         int upperBound, bool verbose) {
-    char outputBuffer[TAPE_LENGTH];  // Buffer used for printing
-    char pointerBuffer[TAPE_LENGTH];
+    char outputBuffer[TAPE_LENGTH + 1];  // Buffer used for printing
+    char pointerBuffer[TAPE_LENGTH + 3];
 
-    int pointer = (m->pointer == 0) ? 1 : m->pointer;
-
-    for (int i = 0; i <= pointer; i++) {
-        pointerBuffer[i] = ' ';
-    }
     char *name = configInfo->name;
     char *match = branchInfo->matchSymbol;
     char *ops = branchInfo->opsString;
@@ -631,22 +1099,34 @@ void print_machine(int passCount, IConfig *configInfo, IBranch *branchInfo,
     printf("\n Pass %i:\n  %s:\t%s | %s | %s\n", passCount, name, match, ops,
             next);
 
+    if (lowerBound == -1 && upperBound == -1) {
+        lowerBound = 0;
+        upperBound = topPointerAccessed + 1;
+    }
+    if (lowerBound < 0) {
+        lowerBound = 0;
+    }
+    if (upperBound > TAPE_LENGTH) {
+        upperBound = TAPE_LENGTH;
+    }
+
+    int end = (topPointerAccessed + 1 < upperBound) ? topPointerAccessed + 1 : upperBound;
+    int length = (end > lowerBound) ? end - lowerBound : 0;
+    memcpy(outputBuffer, m->tape + lowerBound, length);
+    outputBuffer[length] = '\0';
+
     // On the first pass the pointer will be set to 0, but
     // we want it to point on a blank space in the tape
-    strcpy(outputBuffer, m->tape);
-    outputBuffer[topPointerAccessed + 1] = '\0';
+    int pointer = (m->pointer == 0) ? 1 : m->pointer;
 
     // +1 since we need to make up for the '[' character
-    pointerBuffer[pointer - lowerBound + 1] = 'v';
-    pointerBuffer[pointer - lowerBound + 2] = '\0';
-
-    if (lowerBound != -1 || upperBound != -1) {
-        char boundBuffer[TAPE_LENGTH * 2];
-        outputBuffer[upperBound] = 0;
-        strcpy(boundBuffer, outputBuffer + lowerBound);
-        strcpy(outputBuffer, boundBuffer);
-        outputBuffer[lowerBound + upperBound] = '\0';
+    int marker = pointer - lowerBound + 1;
+    if (marker < 0 || marker > TAPE_LENGTH + 1) {
+        marker = 0;
     }
+    memset(pointerBuffer, ' ', marker);
+    pointerBuffer[marker] = 'v';
+    pointerBuffer[marker + 1] = '\0';
 
     char leftLimit = '[';
     char rightLimit = ']';
@@ -661,23 +1141,155 @@ void print_machine(int passCount, IConfig *configInfo, IBranch *branchInfo,
             rightLimit);
 }
 
-// void run_machine(Context *context, Machine *m, int iterations, char *result,
+// Finds the branch of the configuration that matches the given symbol.
+// Returns NULL if no branch matches it.
+Branch *find_branch(Configuration *config, char symbol) {
+    for (int branchIndex = 0; branchIndex < config->info->branchCount;
+            branchIndex++) {
+        Branch *branch = &config->branches[branchIndex];
+        if (branch->matchSymbol == symbol ||
+                (branch->matchSymbol == ANY && symbol == '0') ||
+                (branch->matchSymbol == ANY && symbol == '1') ||
+                (branch->matchSymbol == ELSE)) {
+            return branch;
+        }
+    }
+    return NULL;
+}
+
+void execute_branch(Machine *m, Branch *branch) {
+    // Execute all operations in branch until a N
+    for (int operationIndex = 0; operationIndex < MAX_OPERATION_COUNT;
+            ++operationIndex) {
+        Operation *operation = &branch->ops[operationIndex];
+        switch (operation->name) {
+            case N: {
+                        return;
+                    } break;
+            case P: {
+                        print(m, operation->string);
+                    } break;
+            case E: {
+                        erase(m);
+                    } break;
+            case R: {
+                        right(m, operation->number);
+                    } break;
+            case L: {
+                        left(m, operation->number);
+                    } break;
+        }
+    }
+}
+
+// Checks whether executing the branch with the head at 'pointer' only
+// reads and writes cells in the range [low, high). The head itself is
+// allowed to end up outside of the range.
+bool branch_within(Branch *branch, int pointer, int low, int high) {
+    if (pointer < low || pointer >= high) {
+        return false;
+    }
+    for (int operationIndex = 0; operationIndex < MAX_OPERATION_COUNT;
+            ++operationIndex) {
+        Operation *operation = &branch->ops[operationIndex];
+        switch (operation->name) {
+            case N: {
+                        return true;
+                    } break;
+            case P: {
+                        // Mirrors print(), which steps two cells to the
+                        // right after each symbol of a longer string
+                        size_t length = strlen(operation->string);
+                        if (length > 1) {
+                            int last = pointer + 2 * ((int)length - 1);
+                            if (pointer < low || last >= high) {
+                                return false;
+                            }
+                            pointer += 2 * (int)length;
+                        } else if (pointer < low || pointer >= high) {
+                            return false;
+                        }
+                    } break;
+            case E: {
+                        if (pointer < low || pointer >= high) {
+                            return false;
+                        }
+                    } break;
+            case R: {
+                        pointer += operation->number;
+                    } break;
+            case L: {
+                        pointer -= operation->number;
+                    } break;
+        }
+    }
+    return true;
+}
+
+void no_branch_error(Context *context, Configuration *config, char symbol) {
+    char buffer[256];
+    sprintf(buffer, "No branch matching the symbol '%c' was found for configuration '%s'", symbol, config->info->name);
+
+    error(context, buffer, config->info->definedOn);
+}
+
+// Executes a single pass of the machine from its current configuration.
+// Returns false if the head is outside of the tape or no branch matched
+// the scanned symbol, in which case an error has been reported.
+bool step_machine(Context *context, Machine *m) {
+    if (!head_on_tape(context, m)) {
+        return false;
+    }
+
+    Configuration *config = &m->configurations[m->configuration];
+    char symbol = m->tape[m->pointer];
+    Branch *branch = find_branch(config, symbol);
+    if (branch == NULL) {
+        no_branch_error(context, config, symbol);
+        return false;
+    }
+
+    execute_branch(m, branch);
+    if (m->pointer > m->topPointerAccessed) {
+        m->topPointerAccessed = m->pointer;
+    }
+    m->configuration = branch->nextConfiguration;
+    return true;
+}
+
+// Here we want to print the result of the computation
+// into a buffer for printing.
+// We do this by writing every second value from the turing
+// machine's tape into the result buffer (following turing's
+// conventions).
+void read_result(Machine *m, char *result) {
+    int maxIndex = 2 * (int)floor(m->topPointerAccessed / 2) + 2;
+    if (maxIndex > TAPE_LENGTH) {
+        // The head can leave the tape on the last pass of a failed run
+        maxIndex = TAPE_LENGTH;
+    }
+    int resultIndex = 0;
+    for (int tapeIndex = 0; tapeIndex < maxIndex; tapeIndex += 2) {
+        result[resultIndex++] = m->tape[tapeIndex];
+    }
+    result[resultIndex] = '\0';
+}
+
 void run_machine(Context *context, Machine *m, int iterations, char *result,
         bool verbose) {
-    int topPointerAccessed = 1;  // Value used for determining how much to print
     int window = 48;
     int highBound = window;
     int lowBound = 0;
 
-    int configuration;
-
     int passCount = 0;
 
     while (iterations-- > 0) {
         ++passCount;
-        assert(m->pointer <= TAPE_LENGTH);
+        if (!head_on_tape(context, m)) {
+            return;
+        }
 
-        Configuration config = m->configurations[configuration];
+        Configuration config = m->configurations[m->configuration];
         for (int branchIndex = 0; branchIndex < MAX_BRANCH_COUNT;
                 branchIndex++) {
             char symbol = m->tape[m->pointer];
@@ -700,192 +1312,2688 @@ void run_machine(Context *context, Machine *m, int iterations, char *result,
                     (branch.matchSymbol == ANY && symbol == '0') ||
                     (branch.matchSymbol == ANY && symbol == '1') ||
                     (branch.matchSymbol == ELSE)) {
-                // Execute all operations in branch until a N
-                bool nop = false;
-                for (int operationIndex = 0; operationIndex < MAX_OPERATION_COUNT;
-                        ++operationIndex) {
-                    Operation operation = branch.ops[operationIndex];
-                    switch (operation.name) {
-                        case N: {
-                                    nop = true;
-                                } break;
-                        case P: {
-                                    print(m, operation.string);
-                                } break;
-                        case E: {
-                                    erase(m);
-                                } break;
-                        case R: {
-                                    right(m, operation.number);
-                                } break;
-                        case L: {
-                                    left(m, operation.number);
-                                } break;
-                    }
-                    if (nop) {
-                        break;
-                    }
-                }
+                execute_branch(m, &branch);
             } else {
                 continue;
             }
             // Change topPointerAccessed if we have
             // touched a higher pointer.
             // This is for printing purposes.
-            if (m->pointer > topPointerAccessed) {
-                topPointerAccessed = m->pointer;
+            if (m->pointer > m->topPointerAccessed) {
+                m->topPointerAccessed = m->pointer;
             }
             // Adjust the window of the tape to print
             // if we move out of the defined boundaries
             if (m->pointer >= highBound || m->pointer <= lowBound) {
-                if (topPointerAccessed - m->pointer >= window / 2) {
+                if (m->topPointerAccessed - m->pointer >= window / 2) {
                     highBound = m->pointer + window / 2;
                     lowBound = m->pointer - window / 2;
                 } else {
-                    highBound = topPointerAccessed + 1;
+                    highBound = m->topPointerAccessed + 1;
                     lowBound = highBound - window;
                 }
             }
             if (verbose) {
-                print_machine(passCount, config.info, branch.info, m, topPointerAccessed,
-                        lowBound, highBound, true);
+                print_machine(passCount, config.info, branch.info, m,
+                        m->topPointerAccessed, lowBound, highBound, true);
             }
-            configuration = branch.nextConfiguration;
+            m->configuration = branch.nextConfiguration;
             break;
         }
     }
 
-    // Here we want to print the result of the computation
-    // into a buffer for printing.
-    // We do this by writing every second value from the turing
-    // machine's tape into the result buffer (following turing's
-    // conventions).
-
-    int maxIndex = 2 * (int)floor(topPointerAccessed / 2) + 2;
-    int resultIndex = 0;
-    for (int tapeIndex = 0; tapeIndex < maxIndex; tapeIndex += 2) {
-        result[resultIndex++] = m->tape[tapeIndex];
-    }
+    read_result(m, result);
 }
 
-Machine translate(IR *ir) {
-    Machine m;
+/*
+ * Here we define breakpoints and watchpoints. When any of them are
+ * armed, the machine is run by run_machine_debug, which only checks the
+ * kinds of breakpoints that are armed. Otherwise the regular engines
+ * run without any checks at all.
+ */
+typedef struct Breakpoints {
+    bool armed;
 
-    for (int i = 0; i < TAPE_LENGTH; i++) {
-        m.tape[i] = NONE;
-    }
+    // As given on the command line, resolved by arm_breakpoints
+    int configNameCount;
+    char *configNames[MAX_BREAKPOINT_COUNT];
+    int lineCount;
+    int lines[MAX_BREAKPOINT_COUNT];
 
-    for (int ci = 0; ci < ir->configCount; ci++) {
-        Configuration *conf = &m.configurations[ci];
-        IConfig iconf = ir->configs[ci];
-        conf->info = &ir->configs[ci];
-
-        // Iterate over each branch in each configuration
-        // and fill in its information from the ir
-        for (int bi = 0; bi < iconf.branchCount; bi++) {
-            Branch *branch = &conf->branches[bi];
-            IBranch ibranch = iconf.branches[bi];
-            branch->info = &ir->configs[ci].branches[bi];
-
-            // Set the value for the match symbol,
-            // translating keywords into their correlated value.
-            if (strcmp(ibranch.matchSymbol, "none") == 0) {
-                branch->matchSymbol = NONE;
-            } else if (strcmp(ibranch.matchSymbol, "any") == 0) {
-                branch->matchSymbol = ANY;
-            } else if (strcmp(ibranch.matchSymbol, "else") == 0) {
-                branch->matchSymbol = ELSE;
-            } else {
-                branch->matchSymbol = ibranch.matchSymbol[0];
-            }
+    bool configs[MAX_CONF_COUNT];
+    bool branches[MAX_CONF_COUNT][MAX_BRANCH_COUNT];
+    bool anyBranches;
+    int cellCount;
+    int cells[MAX_BREAKPOINT_COUNT];  // Break when the cell is written
+    int headCount;
+    int heads[MAX_BREAKPOINT_COUNT];  // Break when the head gets here
+} Breakpoints;
 
-            // Determine the index of the next configuration
-            // by iterating over the configurations and finding
-            // the one with the correct name.
-            for (int ci = 0; ci < ir->configCount; ci++) {
-                if (ibranch.next->name == ir->configs[ci].name) {
-                    branch->nextConfiguration = ci;
-                }
-            }
+void arm_breakpoints(Context *c, Breakpoints *breakpoints, IR *ir) {
+    for (int i = 0; i < breakpoints->configNameCount; i++) {
+        int index = find_config(ir->configs, breakpoints->configNames[i]);
+        if (index == NOT_DEFINED) {
+            char buffer[256];
+            snprintf(buffer, sizeof(buffer), "breakpoint on unknown configuration '%s'",
+                    breakpoints->configNames[i]);
+            error(c, buffer, ARGUMENT_ERROR);
+            continue;
+        }
+        breakpoints->configs[index] = true;
+        breakpoints->armed = true;
+    }
 
-            // Fill in the operations for the current branch
-            for (int oi = 0; oi < ibranch.opCount; oi++) {
-                Operation *op = &branch->ops[oi];
-                IOperation iop = ibranch.ops[oi];
-                switch (iop.name) {
-                    case 'N': {
-                                  op->name = N;
-                              } break;
-                    case 'E': {
-                                  op->name = E;
-                              } break;
-                    case 'P': {
-                                  op->name = P;
-                                  op->string = iop.string;
-                              } break;
-                    case 'R': {
-                                  op->name = R;
-                                  op->number = iop.number;
-                                  if (iop.number == 0) {
-                                      op->number = 1;
-                                  }
-                              } break;
-                    case 'L': {
-                                  op->name = L;
-                                  if (iop.number == 0) {
-                                      op->number = 1;
-                                  }
-                              } break;
+    for (int i = 0; i < breakpoints->lineCount; i++) {
+        // Lines are counted from 1 on the command line
+        int line = breakpoints->lines[i] - 1;
+        bool found = false;
+        for (int ci = 0; ci < ir->configCount; ci++) {
+            for (int bi = 0; bi < ir->configs[ci].branchCount; bi++) {
+                if (ir->configs[ci].branches[bi].definedOn == line) {
+                    breakpoints->branches[ci][bi] = true;
+                    found = true;
                 }
             }
         }
+        if (!found) {
+            char buffer[128];
+            sprintf(buffer, "no branch is defined on line %i", line + 1);
+            error(c, buffer, ARGUMENT_ERROR);
+        }
+        breakpoints->anyBranches = true;
+        breakpoints->armed = true;
+    }
+
+    if (breakpoints->cellCount > 0 || breakpoints->headCount > 0) {
+        breakpoints->armed = true;
     }
-    return m;
 }
 
-int main(int argc, char *argv[]) {
-    Context c = {0};
+// Checks whether executing the branch with the head at 'pointer'
+// writes to 'cell'. Mirrors execute_branch.
+bool branch_writes_cell(Branch *branch, int pointer, int cell) {
+    for (int operationIndex = 0; operationIndex < MAX_OPERATION_COUNT;
+            ++operationIndex) {
+        Operation *operation = &branch->ops[operationIndex];
+        switch (operation->name) {
+            case N: {
+                        return false;
+                    } break;
+            case P: {
+                        size_t length = strlen(operation->string);
+                        if (length > 1) {
+                            int offset = cell - pointer;
+                            if (offset >= 0 && offset % 2 == 0 &&
+                                    offset / 2 < (int)length) {
+                                return true;
+                            }
+                            pointer += 2 * (int)length;
+                        } else if (pointer == cell) {
+                            return true;
+                        }
+                    } break;
+            case E: {
+                        if (pointer == cell) {
+                            return true;
+                        }
+                    } break;
+            case R: {
+                        pointer += operation->number;
+                    } break;
+            case L: {
+                        pointer -= operation->number;
+                    } break;
+        }
+    }
+    return false;
+}
 
-    int timesToRun = -1;
-    char *filename = 0;
-    bool verbose = false;
+void dump_tape(Machine *m) {
+    int end = m->topPointerAccessed + 1;
+    if (end > TAPE_LENGTH) {
+        end = TAPE_LENGTH;
+    }
+    printf("\n");
+    for (int row = 0; row < end; row += 64) {
+        printf("  %5i  ", row);
+        for (int i = row; i < row + 64 && i < end; i++) {
+            putchar(m->tape[i]);
+        }
+        printf("\n");
+    }
+}
+
+/*
+ * Here we define recording, which lets the debugger run the machine
+ * backwards. Every pass leaves an UndoStep in the log, and write_cell
+ * logs every cell before overwriting it, so stepping back a pass is a
+ * matter of restoring its cells in reverse order.
+ *
+ * Undoing a long way takes as long as getting there, so every
+ * 'interval' passes a checkpoint of the whole machine is taken as well.
+ * A checkpoint only copies the pages of the tape that were written since
+ * the one before it, and shares the rest. Jumping far back restores the
+ * closest earlier checkpoint and replays forward from there, which never
+ * takes more than 'interval' passes.
+ */
+UndoLog *create_undo_log(int interval) {
+    UndoLog *undo = (UndoLog *)calloc(1, sizeof(UndoLog));
+    undo->interval = interval;
+    return undo;
+}
+
+void release_page(TapePage *page) {
+    if (--page->references == 0) {
+        free(page);
+    }
+}
+
+void take_checkpoint(UndoLog *undo, Machine *m) {
+    if (undo->checkpointCount == undo->checkpointCapacity) {
+        undo->checkpointCapacity = undo->checkpointCapacity ? 2 * undo->checkpointCapacity : 16;
+        undo->checkpoints = (Checkpoint *)realloc(undo->checkpoints,
+                undo->checkpointCapacity * sizeof(Checkpoint));
+    }
+    Checkpoint *previous = (undo->checkpointCount > 0) ?
+        &undo->checkpoints[undo->checkpointCount - 1] : NULL;
+    Checkpoint *checkpoint = &undo->checkpoints[undo->checkpointCount++];
+    checkpoint->pass = undo->stepCount;
+    checkpoint->writeCount = undo->writeCount;
+    checkpoint->pointer = m->pointer;
+    checkpoint->configuration = m->configuration;
+    checkpoint->topPointerAccessed = m->topPointerAccessed;
+
+    for (int page = 0; page < TAPE_PAGE_COUNT; page++) {
+        if (previous != NULL && !undo->dirty[page]) {
+            checkpoint->pages[page] = previous->pages[page];
+            checkpoint->pages[page]->references++;
+        } else {
+            TapePage *copy = (TapePage *)malloc(sizeof(TapePage));
+            copy->references = 1;
+            memcpy(copy->cells, m->tape + page * TAPE_PAGE_SIZE, TAPE_PAGE_SIZE);
+            checkpoint->pages[page] = copy;
+        }
+        undo->dirty[page] = false;
+    }
+}
+
+// Drops the checkpoints taken after the given pass
+void drop_checkpoints(UndoLog *undo, int pass) {
+    while (undo->checkpointCount > 1 &&
+            undo->checkpoints[undo->checkpointCount - 1].pass > pass) {
+        Checkpoint *checkpoint = &undo->checkpoints[--undo->checkpointCount];
+        for (int page = 0; page < TAPE_PAGE_COUNT; page++) {
+            release_page(checkpoint->pages[page]);
+
+            // The tape is now compared against an older checkpoint
+            undo->dirty[page] = true;
+        }
+    }
+}
+
+void start_recording(UndoLog *undo, Machine *m) {
+    m->undo = undo;
+    if (undo->checkpointCount == 0) {
+        take_checkpoint(undo, m);
+    }
+}
+
+void free_undo_log(UndoLog *undo, Machine *m) {
+    m->undo = NULL;
+    drop_checkpoints(undo, -1);
+    if (undo->checkpointCount > 0) {
+        for (int page = 0; page < TAPE_PAGE_COUNT; page++) {
+            release_page(undo->checkpoints[0].pages[page]);
+        }
+    }
+    free(undo->checkpoints);
+    free(undo->steps);
+    free(undo->writes);
+    free(undo);
+}
+
+// Executes a branch the same way step_machine does, and leaves an undo
+// step behind if the machine is being recorded.
+void execute_recorded(Machine *m, Branch *branch) {
+    UndoLog *undo = m->undo;
+    if (undo == NULL) {
+        execute_branch(m, branch);
+        if (m->pointer > m->topPointerAccessed) {
+            m->topPointerAccessed = m->pointer;
+        }
+        m->configuration = branch->nextConfiguration;
+        return;
+    }
+
+    if (undo->stepCount == undo->stepCapacity) {
+        undo->stepCapacity = undo->stepCapacity ? 2 * undo->stepCapacity : 4096;
+        undo->steps = (UndoStep *)realloc(undo->steps,
+                undo->stepCapacity * sizeof(UndoStep));
+    }
+    UndoStep *step = &undo->steps[undo->stepCount];
+    Configuration *config = &m->configurations[m->configuration];
+    int pointer = m->pointer;
+    int top = m->topPointerAccessed;
+    size_t writeCount = undo->writeCount;
+    step->configuration = (uint16_t)m->configuration;
+    step->branch = (uint8_t)(branch - config->branches);
+
+    execute_branch(m, branch);
+    if (m->pointer > m->topPointerAccessed) {
+        m->topPointerAccessed = m->pointer;
+    }
+    m->configuration = branch->nextConfiguration;
+
+    step->pointerDelta = m->pointer - pointer;
+    step->topDelta = m->topPointerAccessed - top;
+    step->writeCount = (uint32_t)(undo->writeCount - writeCount);
+    if (++undo->stepCount % undo->interval == 0) {
+        take_checkpoint(undo, m);
+    }
+}
+
+void undo_pass(UndoLog *undo, Machine *m) {
+    UndoStep *step = &undo->steps[--undo->stepCount];
+    for (uint32_t i = 0; i < step->writeCount; i++) {
+        UndoWrite *write = &undo->writes[--undo->writeCount];
+        m->tape[write->cell] = write->previous;
+        undo->dirty[write->cell / TAPE_PAGE_SIZE] = true;
+    }
+    m->pointer -= step->pointerDelta;
+    m->topPointerAccessed -= step->topDelta;
+    m->configuration = step->configuration;
+    drop_checkpoints(undo, undo->stepCount);
+}
+
+// Runs a recorded machine forward to the given pass. Only used for
+// passes the machine has already made once, which cannot fail.
+void replay_to(UndoLog *undo, Machine *m, int pass) {
+    while (undo->stepCount < pass) {
+        Configuration *config = &m->configurations[m->configuration];
+        execute_recorded(m, find_branch(config, m->tape[m->pointer]));
+    }
+}
+
+// Brings a recorded machine back to the state it was in after the
+// given pass
+void rewind_machine(UndoLog *undo, Machine *m, int pass) {
+    if (undo->stepCount - pass <= undo->interval) {
+        while (undo->stepCount > pass) {
+            undo_pass(undo, m);
+        }
+        return;
+    }
+
+    int index = undo->checkpointCount - 1;
+    while (undo->checkpoints[index].pass > pass) {
+        index--;
+    }
+    drop_checkpoints(undo, undo->checkpoints[index].pass);
+
+    Checkpoint *checkpoint = &undo->checkpoints[index];
+    for (int page = 0; page < TAPE_PAGE_COUNT; page++) {
+        memcpy(m->tape + page * TAPE_PAGE_SIZE, checkpoint->pages[page]->cells,
+                TAPE_PAGE_SIZE);
+        undo->dirty[page] = false;
+    }
+    m->pointer = checkpoint->pointer;
+    m->configuration = checkpoint->configuration;
+    m->topPointerAccessed = checkpoint->topPointerAccessed;
+    undo->stepCount = checkpoint->pass;
+    undo->writeCount = checkpoint->writeCount;
+
+    replay_to(undo, m, pass);
+}
+
+// Shows where a recorded machine is after going back
+void print_recorded(Machine *m, int window) {
+    UndoLog *undo = m->undo;
+    if (undo->stepCount == 0) {
+        printf("\n Pass 0: the machine has not started yet\n\n");
+        return;
+    }
+    UndoStep *step = &undo->steps[undo->stepCount - 1];
+    Configuration *config = &m->configurations[step->configuration];
+    print_machine(undo->stepCount, config->info, config->branches[step->branch].info,
+            m, m->topPointerAccessed, m->pointer - window / 2,
+            m->pointer + window / 2, true);
+}
+
+typedef enum DebugCommand { Continue, Step, Back, Jump, Quit } DebugCommand;
+
+// Asks what to do after a breakpoint has been hit. If stdin is closed,
+// the machine simply continues. For a jump, the pass is put in 'target'.
+DebugCommand debug_prompt(Machine *m, int *target) {
+    char line[64];
+    while (true) {
+        printf(" (c)ontinue, (s)tep, (b)ack, (j)ump <pass>, (d)ump, (q)uit > ");
+        fflush(stdout);
+        if (fgets(line, sizeof(line), stdin) == NULL) {
+            printf("\n");
+            return Continue;
+        }
+        char *command = trim(line);
+        switch (*command) {
+            case '\0':
+            case 'c':
+                return Continue;
+            case 's':
+                return Step;
+            case 'b':
+                return Back;
+            case 'j':
+                if (is_number(trim(command + 1))) {
+                    *target = atoi(trim(command + 1));
+                    return Jump;
+                }
+                printf(" Usage: j <pass>\n");
+                break;
+            case 'q':
+                return Quit;
+            case 'd':
+                dump_tape(m);
+                break;
+            default:
+                printf(" Unknown command '%s'\n", line);
+        }
+    }
+}
+
+int run_machine_debug(Context *context, Machine *m, int iterations,
+        char *result, Breakpoints *breakpoints, UndoLog *undo) {
+    int window = 48;
+    bool stepping = false;
+    int passCount = 0;
+    int stopAt = -1;  // Pass to stop at after a jump forward
+    if (undo != NULL) {
+        start_recording(undo, m);
+    }
+
+    while (iterations-- > 0) {
+        ++passCount;
+        if (!head_on_tape(context, m)) {
+            break;
+        }
+
+        int configIndex = m->configuration;
+        Configuration *config = &m->configurations[configIndex];
+        char symbol = m->tape[m->pointer];
+        Branch *branch = find_branch(config, symbol);
+        if (branch == NULL) {
+            no_branch_error(context, config, symbol);
+            break;
+        }
+
+        char reason[128] = {0};
+        if (breakpoints->configs[configIndex]) {
+            sprintf(reason, "configuration '%.64s'", config->info->name);
+        } else if (breakpoints->anyBranches &&
+                breakpoints->branches[configIndex][branch - config->branches]) {
+            sprintf(reason, "line %i", branch->info->definedOn + 1);
+        }
+        for (int i = 0; i < breakpoints->cellCount; i++) {
+            if (branch_writes_cell(branch, m->pointer, breakpoints->cells[i])) {
+                sprintf(reason, "cell %i was written", breakpoints->cells[i]);
+            }
+        }
+
+        execute_recorded(m, branch);
+
+        for (int i = 0; i < breakpoints->headCount; i++) {
+            if (m->pointer == breakpoints->heads[i]) {
+                sprintf(reason, "head reached cell %i", m->pointer);
+            }
+        }
+
+        // A recorded machine stops after the last pass, so that
+        // it can still be taken back
+        bool finished = undo != NULL && iterations == 0;
+        if (reason[0] != '\0' || stepping || passCount == stopAt || finished) {
+            if (reason[0] != '\0') {
+                printf("\n Breakpoint: %s", reason);
+            }
+            print_machine(passCount, config->info, branch->info, m,
+                    m->topPointerAccessed, m->pointer - window / 2,
+                    m->pointer + window / 2, true);
+
+            int target = 0;
+            DebugCommand command = debug_prompt(m, &target);
+            while (command == Back || command == Jump) {
+                if (command == Back) {
+                    target = passCount - 1;
+                }
+                if (undo == NULL) {
+                    printf(" Run with --record to be able to go back\n");
+                } else if (target > passCount) {
+                    stopAt = target;
+                    command = Continue;
+                    break;
+                } else {
+                    if (target < 0) {
+                        target = 0;
+                    }
+                    rewind_machine(undo, m, target);
+                    iterations += passCount - target;
+                    passCount = target;
+                    print_recorded(m, window);
+                }
+                command = debug_prompt(m, &target);
+            }
+            stepping = command == Step;
+            if (command == Quit) {
+                break;
+            }
+        }
+    }
+
+    read_result(m, result);
+    if (undo != NULL) {
+        free_undo_log(undo, m);
+    }
+    return passCount;
+}
+
+/*
+ * Here we define loop detection, used by '--detect-loops'. The machine
+ * keeps a hash of its tape that is updated with every write, and after
+ * each pass the hash of the whole state is compared against a saved
+ * state, using Brent's cycle detection. The saved state is moved
+ * forward at every power of two, and a matching hash is confirmed
+ * against a copy of the saved state, so hash collisions can not cause
+ * a false report.
+ */
+typedef struct LoopReport {
+    bool found;
+    long long pass;  // The pass at which the loop was noticed
+    int length;
+    bool configs[MAX_CONF_COUNT];  // Configurations visited in the loop
+} LoopReport;
+
+uint64_t state_hash(Machine *m) {
+    return m->tapeHash ^ mix_hash(((uint64_t)m->configuration << 32) ^
+            (uint32_t)m->pointer ^ 0xa5a5a5a5ull);
+}
+
+// Runs the machine while looking for a repeated state. If 'stop' is set,
+// the machine stops as soon as a loop is found. Otherwise the remaining
+// whole trips around the loop are skipped, which leaves the machine in
+// the same state as if they had been run.
+void run_machine_checked(Context *context, Machine *m, int iterations,
+        char *result, LoopReport *report, bool stop) {
+    memset(report, 0, sizeof(LoopReport));
+
+    m->tapeHash = 0;
+    for (int i = 0; i < TAPE_LENGTH; i++) {
+        m->tapeHash ^= cell_hash(i, m->tape[i]);
+    }
+    m->hashing = true;
+
+    char *savedTape = (char *)malloc(TAPE_LENGTH);
+    memcpy(savedTape, m->tape, TAPE_LENGTH);
+    uint64_t savedHash = state_hash(m);
+    int savedPointer = m->pointer;
+    int savedConfiguration = m->configuration;
+    int power = 1;
+    int length = 0;
+    long long passCount = 0;
+
+    while (iterations-- > 0) {
+        if (!step_machine(context, m)) {
+            m->hashing = false;
+            free(savedTape);
+            return;
+        }
+        ++passCount;
+        if (report->found) {
+            continue;
+        }
+
+        report->configs[m->configuration] = true;
+        length++;
+        if (state_hash(m) == savedHash && m->pointer == savedPointer &&
+                m->configuration == savedConfiguration &&
+                memcmp(m->tape, savedTape, TAPE_LENGTH) == 0) {
+            report->found = true;
+            report->pass = passCount;
+            report->length = length;
+            if (stop) {
+                break;
+            }
+            iterations %= length;
+        } else if (length == power) {
+            memcpy(savedTape, m->tape, TAPE_LENGTH);
+            savedHash = state_hash(m);
+            savedPointer = m->pointer;
+            savedConfiguration = m->configuration;
+            power *= 2;
+            length = 0;
+            memset(report->configs, 0, sizeof(report->configs));
+        }
+    }
+
+    m->hashing = false;
+    free(savedTape);
+    read_result(m, result);
+}
+
+void print_loop_report(LoopReport *report, IR *ir) {
+    if (!report->found) {
+        return;
+    }
+    printf("\n Loop:\t\tthe machine repeats itself every %i pass%s (noticed at pass %lld)\n",
+            report->length, report->length == 1 ? "" : "es", report->pass);
+    printf(" Involved:\t");
+    bool first = true;
+    for (int ci = 0; ci < MAX_CONF_COUNT; ci++) {
+        if (report->configs[ci]) {
+            printf(first ? "%s" : ", %s", ir->configs[ci].name);
+            first = false;
+        }
+    }
+    printf("\n");
+}
+
+/*
+ * Here we define the block simulation, which is an accelerated
+ * alternative to run_machine for long runs. The tape is split into
+ * blocks of 'blockSize' cells. The first time the machine enters a
+ * block with a given configuration, head offset and block contents,
+ * we step through the passes normally until the head leaves the block,
+ * and remember the outcome as a macro transition. The next time the
+ * same situation occurs, the transition is replayed in one go.
+ */
+uint32_t hash_block(int configuration, int entry, char *block, int blockSize) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    hash = (hash ^ (uint32_t)configuration) * 16777619u;
+    hash = (hash ^ (uint32_t)entry) * 16777619u;
+    for (int i = 0; i < blockSize; i++) {
+        hash = (hash ^ (unsigned char)block[i]) * 16777619u;
+    }
+    return hash;
+}
+
+void run_machine_blocked(Context *context, Machine *m, int iterations,
+        char *result, int blockSize) {
+    assert(blockSize > 0 && blockSize <= MAX_BLOCK_SIZE);
+    MacroTransition *cache =
+        (MacroTransition *)calloc(MACRO_CACHE_SIZE, sizeof(MacroTransition));
+
+    while (iterations > 0) {
+        int base = (m->pointer / blockSize) * blockSize;
+        if (m->pointer < 0 || base + blockSize > TAPE_LENGTH) {
+            // Blocks that are not fully on the tape are
+            // simply stepped through one pass at a time
+            if (!step_machine(context, m)) {
+                free(cache);
+                return;
+            }
+            iterations--;
+            continue;
+        }
+
+        char *block = &m->tape[base];
+        int entry = m->pointer - base;
+        uint32_t hash = hash_block(m->configuration, entry, block, blockSize);
+        MacroTransition *t = &cache[hash & (MACRO_CACHE_SIZE - 1)];
+
+        if (t->valid && t->configuration == m->configuration &&
+                t->entry == entry && t->steps <= iterations &&
+                memcmp(t->block, block, blockSize) == 0) {
+            memcpy(block, t->result, blockSize);
+            m->pointer = base + t->exit;
+            if (base + t->top > m->topPointerAccessed) {
+                m->topPointerAccessed = base + t->top;
+            }
+            m->configuration = t->nextConfiguration;
+            iterations -= t->steps;
+            continue;
+        }
+
+        // We have not seen this situation before (or it has been evicted
+        // from the cache), so we compute the transition by stepping
+        // through it, for as long as the passes stay inside the block.
+        MacroTransition computed = {0};
+        computed.configuration = m->configuration;
+        computed.entry = entry;
+        memcpy(computed.block, block, blockSize);
+        computed.top = entry;
+
+        while (computed.steps < iterations && computed.steps < MAX_MACRO_STEPS) {
+            Configuration *config = &m->configurations[m->configuration];
+            Branch *branch = find_branch(config, m->tape[m->pointer]);
+            if (branch == NULL ||
+                    !branch_within(branch, m->pointer, base, base + blockSize)) {
+                break;
+            }
+            execute_branch(m, branch);
+            m->configuration = branch->nextConfiguration;
+            if (m->pointer > m->topPointerAccessed) {
+                m->topPointerAccessed = m->pointer;
+            }
+            if (m->pointer - base > computed.top) {
+                computed.top = m->pointer - base;
+            }
+            computed.steps++;
+            if (m->pointer < base || m->pointer >= base + blockSize) {
+                break;
+            }
+        }
+
+        if (computed.steps == 0) {
+            // The next pass either fails or touches cells outside of the
+            // block, so it can not be part of a macro transition.
+            if (!step_machine(context, m)) {
+                free(cache);
+                return;
+            }
+            iterations--;
+            continue;
+        }
+
+        computed.valid = true;
+        computed.nextConfiguration = m->configuration;
+        computed.exit = m->pointer - base;
+        memcpy(computed.result, block, blockSize);
+        *t = computed;
+        iterations -= computed.steps;
+    }
+
+    free(cache);
+    read_result(m, result);
+}
+
+// Translates a single configuration of the IR into the machine. The
+// branches refer to the next configuration by its index in the IR.
+void translate_config(IR *ir, Machine *m, int ci) {
+    Configuration *conf = &m->configurations[ci];
+    memset(conf, 0, sizeof(Configuration));
+    IConfig iconf = ir->configs[ci];
+    conf->info = &ir->configs[ci];
+
+    // Iterate over each branch in each configuration
+    // and fill in its information from the ir
+    for (int bi = 0; bi < iconf.branchCount; bi++) {
+        Branch *branch = &conf->branches[bi];
+        IBranch ibranch = iconf.branches[bi];
+        branch->info = &ir->configs[ci].branches[bi];
+
+        // Set the value for the match symbol,
+        // translating keywords into their correlated value.
+        if (strcmp(ibranch.matchSymbol, "none") == 0) {
+            branch->matchSymbol = NONE;
+        } else if (strcmp(ibranch.matchSymbol, "any") == 0) {
+            branch->matchSymbol = ANY;
+        } else if (strcmp(ibranch.matchSymbol, "else") == 0) {
+            branch->matchSymbol = ELSE;
+        } else {
+            branch->matchSymbol = ibranch.matchSymbol[0];
+        }
+
+        // The index of the next configuration is its
+        // position in the configuration table.
+        branch->nextConfiguration = (int)(ibranch.next - ir->configs);
+
+        // Fill in the operations for the current branch
+        for (int oi = 0; oi < ibranch.opCount; oi++) {
+            Operation *op = &branch->ops[oi];
+            IOperation iop = ibranch.ops[oi];
+            switch (iop.name) {
+                case 'N': {
+                              op->name = N;
+                          } break;
+                case 'E': {
+                              op->name = E;
+                          } break;
+                case 'P': {
+                              op->name = P;
+                              op->string = iop.string;
+                          } break;
+                case 'R': {
+                              op->name = R;
+                              op->number = iop.number;
+                              if (iop.number == 0) {
+                                  op->number = 1;
+                              }
+                          } break;
+                case 'L': {
+                              op->name = L;
+                              op->number = iop.number;
+                              if (iop.number == 0) {
+                                  op->number = 1;
+                              }
+                          } break;
+            }
+        }
+    }
+}
+
+Machine *translate(IR *ir, Machine *m) {
+    memset(m, 0, sizeof(Machine));
+    m->topPointerAccessed = 1;
+
+    for (int i = 0; i < TAPE_LENGTH; i++) {
+        m->tape[i] = NONE;
+    }
+
+    for (int ci = 0; ci < ir->configCount; ci++) {
+        translate_config(ir, m, ci);
+    }
+    return m;
+}
+
+/*
+ * Here we define the instrumentation used by '--perf'. The phases of the
+ * interpreter are timed separately, and on linux we additionally read
+ * the hardware performance counters around the execution of the machine,
+ * so that the counts are not polluted by parsing and translation.
+ */
+double now_seconds() {
+#if defined(_WIN32)
+    return (double)clock() / CLOCKS_PER_SEC;
+#else
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+#endif
+}
+
+char *perfCounterNames[PERF_COUNTER_COUNT] = {
+    "Cycles", "Instructions", "Branch misses", "L1d misses", "LLC misses",
+};
+
+typedef struct PerfCounters {
+    bool available;
+    int fds[PERF_COUNTER_COUNT];
+    uint64_t values[PERF_COUNTER_COUNT];
+
+    // Share of the run during which the counter was actually counting.
+    // The kernel takes turns with the counters when there are not
+    // enough of them in the CPU, and the values are scaled up to make
+    // up for it.
+    double coverage[PERF_COUNTER_COUNT];
+} PerfCounters;
+
+#if defined(__linux__)
+int open_perf_counter(uint32_t type, uint64_t config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+void start_perf_counters(PerfCounters *counters) {
+    counters->available = false;
+#if defined(__linux__)
+    uint64_t l1Misses = PERF_COUNT_HW_CACHE_L1D |
+        (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    counters->fds[0] = open_perf_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    counters->fds[1] = open_perf_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+    counters->fds[2] = open_perf_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+    counters->fds[3] = open_perf_counter(PERF_TYPE_HW_CACHE, l1Misses);
+    counters->fds[4] = open_perf_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+        if (counters->fds[i] != -1) {
+            counters->available = true;
+            ioctl(counters->fds[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(counters->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+#else
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+        counters->fds[i] = -1;
+    }
+#endif
+}
+
+void stop_perf_counters(PerfCounters *counters) {
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+        counters->values[i] = 0;
+        counters->coverage[i] = 0;
+#if defined(__linux__)
+        if (counters->fds[i] != -1) {
+            ioctl(counters->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+
+            // The value, the time enabled and the time running
+            uint64_t data[3];
+            if (read(counters->fds[i], data, sizeof(data)) == sizeof(data) &&
+                    data[1] > 0 && data[2] > 0) {
+                counters->coverage[i] = (double)data[2] / (double)data[1];
+                counters->values[i] = (uint64_t)(data[0] / counters->coverage[i]);
+            }
+            close(counters->fds[i]);
+        }
+#endif
+    }
+}
+
+void print_perf_report(double parseTime, double translateTime, double runTime,
+        int passes, PerfCounters *counters) {
+    double millions = passes / 1e6;
+    printf("\n Parse:\t\t%0.3f ms\n Translate:\t%0.3f ms\n Run:\t\t%0.3f ms\n",
+            parseTime * 1e3, translateTime * 1e3, runTime * 1e3);
+    if (runTime > 0) {
+        printf(" Passes/sec:\t%0.0f\n", passes / runTime);
+    }
+
+    if (!counters->available) {
+        printf(" Performance counters are not available, only timings are reported\n");
+        return;
+    }
+    printf(" Per million passes:\n");
+    for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+        if (counters->fds[i] == -1) {
+            printf("   %-14s\tn/a\n", perfCounterNames[i]);
+        } else if (counters->coverage[i] == 0) {
+            printf("   %-14s\tnot counted (no counter was free)\n", perfCounterNames[i]);
+        } else if (millions > 0 && counters->coverage[i] < 1) {
+            printf("   %-14s\t%0.0f\t(estimated, counted %0.0f%% of the run)\n",
+                    perfCounterNames[i], counters->values[i] / millions,
+                    counters->coverage[i] * 100);
+        } else if (millions > 0) {
+            printf("   %-14s\t%0.0f\n", perfCounterNames[i],
+                    counters->values[i] / millions);
+        }
+    }
+}
+
+/*
+ * Here we define the output path used by '--output'. Instead of building
+ * the result in buffers on the stack, the F-squares are streamed from
+ * the tape into the file in large chunks, or written straight into a
+ * memory mapping of the file with '--mmap'.
+ */
+typedef enum OutputFormat { BinaryFormat, BytesFormat, DecimalFormat } OutputFormat;
+
+typedef struct OutputStream {
+    int fd;
+    char *buffer;
+    size_t size;
+    size_t used;
+    size_t written;
+    bool mapped;
+    bool failed;
+} OutputStream;
+
+void flush_output(OutputStream *out) {
+    if (out->mapped) {
+        return;
+    }
+    size_t offset = 0;
+    while (offset < out->used && !out->failed) {
+        long count = (long)write(out->fd, out->buffer + offset, out->used - offset);
+        if (count <= 0) {
+            out->failed = true;
+        } else {
+            offset += (size_t)count;
+        }
+    }
+    out->written += out->used;
+    out->used = 0;
+}
+
+void output_byte(OutputStream *out, char byte) {
+    if (out->used == out->size) {
+        flush_output(out);
+    }
+    out->buffer[out->used++] = byte;
+}
+
+// Finds the F-squares that make up the result, skipping the '@'s at the
+// start of the tape and the blanks at the end. 'begin' and 'end' are
+// tape indices, and 'end' is exclusive.
+void result_range(Machine *m, int *begin, int *end) {
+    int maxIndex = 2 * (m->topPointerAccessed / 2) + 2;
+    if (maxIndex > TAPE_LENGTH) {
+        maxIndex = TAPE_LENGTH;
+    }
+    *begin = 0;
+    while (*begin < maxIndex && m->tape[*begin] == '@') {
+        *begin += 2;
+    }
+    *end = maxIndex;
+    while (*end > *begin && m->tape[*end - 2] == NONE) {
+        *end -= 2;
+    }
+}
+
+size_t output_size(Machine *m, OutputFormat format) {
+    int begin, end;
+    result_range(m, &begin, &end);
+    size_t digits = (size_t)(end - begin) / 2;
+    switch (format) {
+        case BinaryFormat:
+            return digits;
+        case BytesFormat:
+            return (digits + 7) / 8;
+        case DecimalFormat:
+            return digits + 3;  // "0." and a newline
+    }
+    return 0;
+}
+
+void stream_result(OutputStream *out, Machine *m, OutputFormat format) {
+    int begin, end;
+    result_range(m, &begin, &end);
+
+    switch (format) {
+        case BinaryFormat: {
+                               for (int i = begin; i < end; i += 2) {
+                                   output_byte(out, m->tape[i]);
+                               }
+                           } break;
+        case BytesFormat: {
+                              // Packs eight F-squares into each byte,
+                              // like parse_string does
+                              for (int i = begin; i < end; i += 16) {
+                                  unsigned char byte = 0;
+                                  for (int bit = 0; bit < 8; bit++) {
+                                      int cell = i + 2 * bit;
+                                      byte <<= 1;
+                                      if (cell < end && m->tape[cell] == '1') {
+                                          byte |= 1;
+                                      }
+                                  }
+                                  output_byte(out, (char)byte);
+                              }
+                          } break;
+        case DecimalFormat: {
+                                // A binary fraction with n digits has exactly n
+                                // decimal digits. We get them one at a time by
+                                // multiplying the fraction by ten and taking
+                                // whatever overflows past the point.
+                                int bits = (end - begin) / 2;
+                                int wordCount = (bits + 31) / 32;
+                                uint32_t *words = (uint32_t *)calloc(wordCount + 1, sizeof(uint32_t));
+                                for (int bit = 0; bit < bits; bit++) {
+                                    if (m->tape[begin + 2 * bit] == '1') {
+                                        words[bit / 32] |= 1u << (31 - bit % 32);
+                                    }
+                                }
+                                output_byte(out, '0');
+                                output_byte(out, '.');
+                                for (int digit = 0; digit < bits; digit++) {
+                                    uint64_t carry = 0;
+                                    for (int w = wordCount - 1; w >= 0; w--) {
+                                        uint64_t product = (uint64_t)words[w] * 10 + carry;
+                                        words[w] = (uint32_t)product;
+                                        carry = product >> 32;
+                                    }
+                                    output_byte(out, (char)('0' + carry));
+                                }
+                                output_byte(out, '\n');
+                                free(words);
+                            } break;
+    }
+}
+
+// Returns the number of bytes written to the file
+size_t write_output(Context *c, Machine *m, char *filename, OutputFormat format,
+        bool useMmap) {
+    OutputStream out = {0};
+    out.fd = open(filename, O_RDWR | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    if (out.fd == -1) {
+        error(c, "output file could not be opened", FILE_ERROR);
+        return 0;
+    }
+
+#if !defined(_WIN32)
+    if (useMmap) {
+        out.size = output_size(m, format);
+        if (out.size == 0) {
+            close(out.fd);
+            return 0;
+        }
+        if (ftruncate(out.fd, (off_t)out.size) == 0) {
+            void *mapping = mmap(NULL, out.size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    out.fd, 0);
+            if (mapping != MAP_FAILED) {
+                out.buffer = (char *)mapping;
+                out.mapped = true;
+            }
+        }
+        if (!out.mapped) {
+            error(c, "output file could not be memory mapped", FILE_ERROR);
+            close(out.fd);
+            return 0;
+        }
+        stream_result(&out, m, format);
+        out.written = out.used;
+        munmap(out.buffer, out.size);
+        close(out.fd);
+        return out.written;
+    }
+#endif
+
+    out.size = OUTPUT_CHUNK_SIZE;
+    out.buffer = (char *)malloc(out.size);
+    stream_result(&out, m, format);
+    flush_output(&out);
+    if (out.failed) {
+        error(c, "output file could not be written", FILE_ERROR);
+    }
+    free(out.buffer);
+    close(out.fd);
+    return out.written;
+}
+
+/*
+ * Here we define pipelines, used by '--pipeline'. Each stage is a
+ * machine running on its own thread. As soon as an F-square of a stage
+ * is filled in, it is forwarded to the next stage through a single
+ * producer, single consumer ring buffer, where it is placed on the
+ * E-squares of that stage's tape, in order. Before every pass, a stage
+ * waits until the input has reached every E-square the pass could touch,
+ * so that the input never lands on a square the machine has already
+ * used, and the result is the same as if the whole input had been on
+ * the tape from the start. A stage whose ring buffer is full waits for
+ * the next one.
+ */
+#if !defined(_WIN32)
+typedef struct RingBuffer {
+    // The producer and consumer positions live on separate cache lines,
+    // so the two threads do not keep stealing each other's line.
+    size_t head;
+    bool done;
+    char producerPadding[64];
+    size_t tail;
+    bool closed;
+    char consumerPadding[64];
+    char symbols[RING_BUFFER_SIZE];
+} RingBuffer;
+
+// Returns false if the consumer has stopped reading, in which case the
+// symbol is dropped.
+bool ring_push(RingBuffer *ring, char symbol) {
+    size_t head = ring->head;
+    while (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == RING_BUFFER_SIZE) {
+        if (__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE)) {
+            return false;
+        }
+        sched_yield();
+    }
+    ring->symbols[head % RING_BUFFER_SIZE] = symbol;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+bool ring_pop(RingBuffer *ring, char *symbol) {
+    size_t tail = ring->tail;
+    if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail) {
+        return false;
+    }
+    *symbol = ring->symbols[tail % RING_BUFFER_SIZE];
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+typedef struct Stage {
+    char *filename;
+    Context context;
+    IR *ir;
+    Machine *m;
+    int passes;
+    char result[TAPE_LENGTH / 2 + 2];
+
+    RingBuffer *input;   // NULL for the first stage
+    RingBuffer *output;  // NULL for the last stage
+    bool inputDone;
+    int reach;    // How far to the right of the head a single pass can go
+    int loaded;   // Number of input symbols placed on the tape
+    int emitted;  // Number of F-squares forwarded to the next stage
+} Stage;
+
+// Returns how far to the right of the head any branch of the machine
+// moves, which bounds the cells that a single pass can touch.
+int furthest_reach(Machine *m) {
+    int reach = 0;
+    for (int ci = 0; ci < MAX_CONF_COUNT && m->configurations[ci].info != NULL; ci++) {
+        Configuration *config = &m->configurations[ci];
+        for (int bi = 0; bi < config->info->branchCount; bi++) {
+            Branch *branch = &config->branches[bi];
+            int offset = 0;
+            for (int oi = 0; oi < MAX_OPERATION_COUNT && branch->ops[oi].name != N; oi++) {
+                Operation *operation = &branch->ops[oi];
+                if (operation->name == R) {
+                    offset += operation->number;
+                } else if (operation->name == L) {
+                    offset -= operation->number;
+                } else if (operation->name == P && strlen(operation->string) > 1) {
+                    offset += 2 * (int)strlen(operation->string);
+                }
+                if (offset > reach) {
+                    reach = offset;
+                }
+            }
+        }
+    }
+    return reach;
+}
+
+// Moves the symbols that are available in the input ring buffer onto the
+// E-squares of the tape. If 'index' is not -1, waits until the input
+// symbol with that index has arrived or the previous stage has finished.
+void load_input(Stage *stage, int index) {
+    while (!stage->inputDone && 2 * stage->loaded + 1 < TAPE_LENGTH) {
+        // Read the flag before trying to pop, so that no symbol pushed
+        // before the previous stage finished can be missed
+        bool done = __atomic_load_n(&stage->input->done, __ATOMIC_ACQUIRE);
+        char symbol;
+        if (ring_pop(stage->input, &symbol)) {
+            stage->m->tape[2 * stage->loaded + 1] = symbol;
+            stage->loaded++;
+        } else if (done) {
+            stage->inputDone = true;
+        } else if (stage->loaded > index) {
+            break;
+        } else {
+            sched_yield();
+        }
+    }
+}
+
+// Forwards the F-squares that have been filled in to the next stage.
+// Once the stage has finished, the rest of its result is forwarded as
+// well, blanks included.
+void emit_output(Stage *stage, bool finished) {
+    Machine *m = stage->m;
+    int end = TAPE_LENGTH;
+    if (finished) {
+        end = 2 * (m->topPointerAccessed / 2) + 2;
+        if (end > TAPE_LENGTH) {
+            end = TAPE_LENGTH;
+        }
+    }
+    while (2 * stage->emitted < end) {
+        char symbol = m->tape[2 * stage->emitted];
+        if (symbol == NONE && !finished) {
+            break;
+        }
+        ring_push(stage->output, symbol);
+        stage->emitted++;
+    }
+}
+
+void *run_stage(void *argument) {
+    Stage *stage = (Stage *)argument;
+    Machine *m = stage->m;
+
+    for (int pass = 0; pass < stage->passes; pass++) {
+        if (stage->input) {
+            // Wait for the input of the last E-square this pass can reach.
+            // Placing it after the machine has written there would
+            // overwrite the machine's own marks, depending on timing.
+            int furthest = m->pointer + stage->reach;
+            if (furthest >= TAPE_LENGTH) {
+                furthest = TAPE_LENGTH - 1;
+            }
+            int index = -1;
+            if (furthest >= 1 && (furthest - 1) / 2 >= stage->loaded) {
+                index = (furthest - 1) / 2;
+            }
+            load_input(stage, index);
+        }
+        if (!step_machine(&stage->context, m)) {
+            break;
+        }
+        if (stage->output) {
+            emit_output(stage, false);
+        }
+    }
+
+    read_result(m, stage->result);
+    if (stage->output) {
+        emit_output(stage, true);
+        __atomic_store_n(&stage->output->done, true, __ATOMIC_RELEASE);
+    }
+    if (stage->input) {
+        __atomic_store_n(&stage->input->closed, true, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+#endif
+
+// Runs the stages and leaves the result of the last one in 'result'.
+// Its final machine is copied to 'last', for writing it to a file.
+void run_pipeline(Context *c, char *filenames[], int stageCount, int passes,
+        char *result, Machine *last) {
+#if defined(_WIN32)
+    error(c, "pipelines are not supported on windows", ARGUMENT_ERROR);
+#else
+    Stage *stages = (Stage *)calloc(stageCount, sizeof(Stage));
+    RingBuffer *rings = (RingBuffer *)calloc(stageCount, sizeof(RingBuffer));
+
+    // Every stage is parsed up front, so that errors in the programs are
+    // reported before anything starts running
+    for (int si = 0; si < stageCount; si++) {
+        Stage *stage = &stages[si];
+        stage->filename = filenames[si];
+        stage->passes = passes;
+        stage->ir = (IR *)calloc(1, sizeof(IR));
+        stage->m = (Machine *)malloc(sizeof(Machine));
+
+        char *bytecode = read_source(c, filenames[si]);
+        handle_errors(c);
+        parse(c, stage->ir, bytecode);
+        translate(stage->ir, stage->m);
+        stage->reach = furthest_reach(stage->m);
+
+        if (si > 0) {
+            stage->input = &rings[si - 1];
+        }
+        if (si < stageCount - 1) {
+            stage->output = &rings[si];
+        }
+    }
+
+    pthread_t *threads = (pthread_t *)malloc(stageCount * sizeof(pthread_t));
+    for (int si = 0; si < stageCount; si++) {
+        pthread_create(&threads[si], NULL, run_stage, &stages[si]);
+    }
+    for (int si = 0; si < stageCount; si++) {
+        pthread_join(threads[si], NULL);
+    }
+
+    for (int si = 0; si < stageCount; si++) {
+        Context *context = &stages[si].context;
+        if (context->nextError > 0) {
+            fprintf(stderr, "\n\tIn stage %i (%s):\n", si + 1, stages[si].filename);
+            handle_errors(context);
+        }
+    }
+    strcpy(result, stages[stageCount - 1].result);
+    memcpy(last, stages[stageCount - 1].m, sizeof(Machine));
+
+    for (int si = 0; si < stageCount; si++) {
+        free(stages[si].m);
+    }
+    free(threads);
+    free(rings);
+    free(stages);
+#endif
+}
+
+/*
+ * Here we define the batch engine used by '--batch', which runs the same
+ * program on many different tapes. The machines are run in groups of
+ * BATCH_WIDTH lanes that advance in lockstep, with the state of the
+ * group kept as one array per field and the tapes interleaved, so that
+ * cell c of lane l is found at c * BATCH_WIDTH + l.
+ *
+ * Before running, every branch is compiled into a BatchTransition: the
+ * cells it writes relative to the head, how far it moves the head and
+ * the configuration it goes to next. A dispatch table then maps each
+ * configuration and scanned symbol directly to a transition. On CPUs
+ * with AVX2, a pass of the whole group is made with gathers from the
+ * tapes and the tables. Lanes that have run into an error are masked out.
+ */
+typedef struct BatchTransition {
+    int32_t delta;       // How far the head moves
+    int32_t next;        // Next configuration
+    int32_t writeStart;  // Index of the first write in the program
+    int32_t writeCount;
+} BatchTransition;
+
+typedef struct BatchWrite {
+    int32_t offset;  // Cell relative to the head before the pass
+    char symbol;
+} BatchWrite;
+
+typedef struct BatchProgram {
+    int32_t *dispatch;  // [configuration * 256 + symbol], -1 if no branch matches
+    BatchTransition *transitions;
+    BatchWrite *writes;
+} BatchProgram;
+
+typedef struct BatchGroup {
+    int32_t pointers[BATCH_WIDTH];
+    int32_t configurations[BATCH_WIDTH];
+    int32_t tops[BATCH_WIDTH];
+    int32_t stopped[BATCH_WIDTH];  // -1 once the lane has stopped, or if it is unused
+
+    // Padded, since the gathers read four bytes at a time
+    char tape[TAPE_LENGTH * BATCH_WIDTH + 4];
+} BatchGroup;
+
+BatchProgram *compile_batch(Machine *m) {
+    int configCount = 0;
+    while (configCount < MAX_CONF_COUNT && m->configurations[configCount].info != NULL) {
+        configCount++;
+    }
+
+    int branchTotal = 0;
+    int writeTotal = 0;
+    for (int ci = 0; ci < configCount; ci++) {
+        Configuration *config = &m->configurations[ci];
+        for (int bi = 0; bi < config->info->branchCount; bi++) {
+            branchTotal++;
+            for (int oi = 0; oi < MAX_OPERATION_COUNT &&
+                    config->branches[bi].ops[oi].name != N; oi++) {
+                Operation *operation = &config->branches[bi].ops[oi];
+                if (operation->name == P) {
+                    size_t length = strlen(operation->string);
+                    writeTotal += (length > 1) ? (int)length : 1;
+                } else if (operation->name == E) {
+                    writeTotal++;
+                }
+            }
+        }
+    }
+
+    BatchProgram *program = (BatchProgram *)malloc(sizeof(BatchProgram));
+    program->dispatch = (int32_t *)malloc((configCount * 256 + 1) * sizeof(int32_t));
+    program->transitions =
+        (BatchTransition *)malloc((branchTotal + 1) * sizeof(BatchTransition));
+    program->writes = (BatchWrite *)malloc((writeTotal + 1) * sizeof(BatchWrite));
+
+    // Mirrors execute_branch, but records the writes instead of making them
+    int transitionCount = 0;
+    int writeCount = 0;
+    for (int ci = 0; ci < configCount; ci++) {
+        Configuration *config = &m->configurations[ci];
+        int first = transitionCount;
+        for (int bi = 0; bi < config->info->branchCount; bi++) {
+            Branch *branch = &config->branches[bi];
+            BatchTransition *transition = &program->transitions[transitionCount++];
+            transition->next = branch->nextConfiguration;
+            transition->writeStart = writeCount;
+
+            int offset = 0;
+            for (int oi = 0; oi < MAX_OPERATION_COUNT && branch->ops[oi].name != N; oi++) {
+                Operation *operation = &branch->ops[oi];
+                switch (operation->name) {
+                    case P: {
+                                char *symbol = operation->string;
+                                if (strlen(symbol) > 1) {
+                                    while (*symbol != '\0') {
+                                        program->writes[writeCount].offset = offset;
+                                        program->writes[writeCount++].symbol = *symbol++;
+                                        offset += 2;
+                                    }
+                                } else {
+                                    program->writes[writeCount].offset = offset;
+                                    program->writes[writeCount++].symbol = *symbol;
+                                }
+                            } break;
+                    case E: {
+                                program->writes[writeCount].offset = offset;
+                                program->writes[writeCount++].symbol = NONE;
+                            } break;
+                    case R: {
+                                offset += operation->number;
+                            } break;
+                    case L: {
+                                offset -= operation->number;
+                            } break;
+                    default:
+                            break;
+                }
+            }
+            transition->delta = offset;
+            transition->writeCount = writeCount - transition->writeStart;
+        }
+
+        for (int symbol = 0; symbol < 256; symbol++) {
+            Branch *branch = find_branch(config, (char)symbol);
+            program->dispatch[ci * 256 + symbol] =
+                (branch == NULL) ? -1 : first + (int)(branch - config->branches);
+        }
+    }
+    return program;
+}
+
+void free_batch(BatchProgram *program) {
+    free(program->dispatch);
+    free(program->transitions);
+    free(program->writes);
+    free(program);
+}
+
+void load_lane(BatchGroup *group, int lane, Machine *m) {
+    group->pointers[lane] = m->pointer;
+    group->configurations[lane] = m->configuration;
+    group->tops[lane] = m->topPointerAccessed;
+    group->stopped[lane] = 0;
+    for (int cell = 0; cell < TAPE_LENGTH; cell++) {
+        group->tape[cell * BATCH_WIDTH + lane] = m->tape[cell];
+    }
+}
+
+void unload_lane(BatchGroup *group, int lane, Machine *m) {
+    m->pointer = group->pointers[lane];
+    m->configuration = group->configurations[lane];
+    m->topPointerAccessed = group->tops[lane];
+    for (int cell = 0; cell < TAPE_LENGTH; cell++) {
+        m->tape[cell] = group->tape[cell * BATCH_WIDTH + lane];
+    }
+}
+
+void apply_writes(BatchProgram *program, BatchGroup *group, int lane, int pointer,
+        int transition) {
+    BatchTransition *t = &program->transitions[transition];
+    for (int i = t->writeStart; i < t->writeStart + t->writeCount; i++) {
+        // Like write_cell, writes that fall outside of the tape are dropped
+        int cell = pointer + program->writes[i].offset;
+        if (cell >= 0 && cell < TAPE_LENGTH) {
+            group->tape[cell * BATCH_WIDTH + lane] = program->writes[i].symbol;
+        }
+    }
+}
+
+// Makes a single pass on every lane that is still running. Returns
+// false once all of them have stopped.
+bool batch_step(BatchProgram *program, BatchGroup *group) {
+    bool running = false;
+    for (int lane = 0; lane < BATCH_WIDTH; lane++) {
+        if (group->stopped[lane]) {
+            continue;
+        }
+        int pointer = group->pointers[lane];
+        if (pointer < 0 || pointer >= TAPE_LENGTH) {
+            group->stopped[lane] = -1;
+            continue;
+        }
+        unsigned char symbol = group->tape[pointer * BATCH_WIDTH + lane];
+        int transition = program->dispatch[group->configurations[lane] * 256 + symbol];
+        if (transition < 0) {
+            group->stopped[lane] = -1;
+            continue;
+        }
+
+        apply_writes(program, group, lane, pointer, transition);
+        pointer += program->transitions[transition].delta;
+        group->pointers[lane] = pointer;
+        group->configurations[lane] = program->transitions[transition].next;
+        if (pointer > group->tops[lane]) {
+            group->tops[lane] = pointer;
+        }
+        running = true;
+    }
+    return running;
+}
+
+#if defined(BATCH_AVX2)
+// Does the same as batch_step, for all passes at once, keeping the state
+// of the lanes in registers in between
+__attribute__((target("avx2")))
+void run_batch_avx2(BatchProgram *program, BatchGroup *group, int iterations) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi32(-1);
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i lastCell = _mm256_set1_epi32(TAPE_LENGTH - 1);
+
+    __m256i pointers = _mm256_loadu_si256((__m256i *)group->pointers);
+    __m256i configs = _mm256_loadu_si256((__m256i *)group->configurations);
+    __m256i tops = _mm256_loadu_si256((__m256i *)group->tops);
+    __m256i stopped = _mm256_loadu_si256((__m256i *)group->stopped);
+    int32_t chosen[BATCH_WIDTH];
+    int32_t heads[BATCH_WIDTH];
+
+    for (int pass = 0; pass < iterations; pass++) {
+        // Lanes with the head outside of the tape stop before reading
+        __m256i outside = _mm256_or_si256(_mm256_cmpgt_epi32(zero, pointers),
+                _mm256_cmpgt_epi32(pointers, lastCell));
+        stopped = _mm256_or_si256(stopped, outside);
+        __m256i running = _mm256_andnot_si256(stopped, ones);
+
+        __m256i cells = _mm256_add_epi32(_mm256_slli_epi32(pointers, BATCH_WIDTH_SHIFT),
+                lanes);
+        __m256i symbols = _mm256_mask_i32gather_epi32(zero, (int *)group->tape, cells,
+                running, 1);
+        symbols = _mm256_and_si256(symbols, _mm256_set1_epi32(0xff));
+        __m256i slots = _mm256_add_epi32(_mm256_slli_epi32(configs, 8), symbols);
+        __m256i transitions = _mm256_mask_i32gather_epi32(ones, (int *)program->dispatch,
+                slots, running, 4);
+
+        // Lanes where no branch matched stop as well
+        stopped = _mm256_or_si256(stopped, _mm256_cmpgt_epi32(zero, transitions));
+        running = _mm256_andnot_si256(stopped, ones);
+        int mask = _mm256_movemask_ps(_mm256_castsi256_ps(running));
+        if (mask == 0) {
+            break;
+        }
+
+        // AVX2 has no scatter, so the writes are made one lane at a time
+        _mm256_storeu_si256((__m256i *)chosen, transitions);
+        _mm256_storeu_si256((__m256i *)heads, pointers);
+        for (int lane = 0; lane < BATCH_WIDTH; lane++) {
+            if (mask & (1 << lane)) {
+                apply_writes(program, group, lane, heads[lane], chosen[lane]);
+            }
+        }
+
+        // Four fields per transition
+        __m256i fields = _mm256_slli_epi32(transitions, 2);
+        __m256i deltas = _mm256_mask_i32gather_epi32(zero,
+                (int *)&program->transitions->delta, fields, running, 4);
+        configs = _mm256_mask_i32gather_epi32(configs,
+                (int *)&program->transitions->next, fields, running, 4);
+        pointers = _mm256_add_epi32(pointers, deltas);
+        tops = _mm256_blendv_epi8(tops, _mm256_max_epi32(tops, pointers), running);
+    }
+
+    _mm256_storeu_si256((__m256i *)group->pointers, pointers);
+    _mm256_storeu_si256((__m256i *)group->configurations, configs);
+    _mm256_storeu_si256((__m256i *)group->tops, tops);
+    _mm256_storeu_si256((__m256i *)group->stopped, stopped);
+}
+#endif
+
+void run_batch_scalar(BatchProgram *program, BatchGroup *group, int iterations) {
+    for (int pass = 0; pass < iterations; pass++) {
+        if (!batch_step(program, group)) {
+            return;
+        }
+    }
+}
+
+typedef void (*BatchRunner)(BatchProgram *program, BatchGroup *group, int iterations);
+
+// Gathers are slow on some CPUs, for instance where the mitigation for
+// gather data sampling is in place. So both ways are timed on a copy of
+// the first group, and the faster one is used for the whole batch.
+BatchRunner choose_batch_runner(BatchProgram *program, BatchGroup *group) {
+#if defined(BATCH_AVX2)
+    if (__builtin_cpu_supports("avx2")) {
+        BatchGroup *trial = (BatchGroup *)malloc(sizeof(BatchGroup));
+        memcpy(trial, group, sizeof(BatchGroup));
+        double start = now_seconds();
+        run_batch_avx2(program, trial, BATCH_TRIAL_PASSES);
+        double vector = now_seconds() - start;
+
+        memcpy(trial, group, sizeof(BatchGroup));
+        start = now_seconds();
+        run_batch_scalar(program, trial, BATCH_TRIAL_PASSES);
+        double scalar = now_seconds() - start;
+        free(trial);
+        return (vector < scalar) ? run_batch_avx2 : run_batch_scalar;
+    }
+#endif
+    return run_batch_scalar;
+}
+
+// Reports why a lane stopped, the same way the other engines would have
+void report_lane_error(Context *context, Machine *m) {
+    if (head_on_tape(context, m)) {
+        Configuration *config = &m->configurations[m->configuration];
+        no_branch_error(context, config, m->tape[m->pointer]);
+    }
+}
+
+// Runs the machine once for every line of 'filename', with the symbols
+// of the line placed on the E-squares of an otherwise blank tape, and
+// prints the result of each run on its own line. If 'outputFile' is
+// given, the results are written to it instead, one line for every
+// input, and the number of bytes written is returned.
+size_t run_batch(Context *context, Machine *m, char *filename, int iterations,
+        char *outputFile, OutputFormat format) {
+    char *inputs = read_source(context, filename);
+    if (inputs == NULL) {
+        return 0;
+    }
+    OutputStream out = {0};
+    if (outputFile) {
+        out.fd = open(outputFile, O_RDWR | O_CREAT | O_TRUNC | O_BINARY, 0644);
+        if (out.fd == -1) {
+            error(context, "output file could not be opened", FILE_ERROR);
+            free(inputs);
+            return 0;
+        }
+        out.size = OUTPUT_CHUNK_SIZE;
+        out.buffer = (char *)malloc(out.size);
+    }
+    BatchProgram *program = compile_batch(m);
+    BatchGroup *group = (BatchGroup *)calloc(1, sizeof(BatchGroup));
+    Machine *lane = (Machine *)malloc(sizeof(Machine));
+    memcpy(lane, m, sizeof(Machine));
+    char result[TAPE_LENGTH / 2 + 2];
+
+    BatchRunner runner = NULL;
+    int count = 0;
+    char *line = inputs;
+    while (*line != '\0') {
+        int loaded = 0;
+        for (; loaded < BATCH_WIDTH && *line != '\0'; loaded++) {
+            char *end = strchr(line, '\n');
+            if (end == NULL) {
+                end = line + strlen(line);
+            }
+            // The lanes of the previous group were unloaded into 'lane'
+            lane->pointer = m->pointer;
+            lane->configuration = m->configuration;
+            lane->topPointerAccessed = m->topPointerAccessed;
+            memcpy(lane->tape, m->tape, TAPE_LENGTH);
+            for (int i = 0; line + i < end && 2 * i + 1 < TAPE_LENGTH; i++) {
+                if (line[i] != '\r') {
+                    lane->tape[2 * i + 1] = line[i];
+                }
+            }
+            load_lane(group, loaded, lane);
+            line = (*end == '\n') ? end + 1 : end;
+        }
+        for (int unused = loaded; unused < BATCH_WIDTH; unused++) {
+            group->stopped[unused] = -1;
+        }
+
+        if (runner == NULL) {
+            runner = choose_batch_runner(program, group);
+        }
+        runner(program, group, iterations);
+
+        for (int i = 0; i < loaded; i++) {
+            unload_lane(group, i, lane);
+            count++;
+            if (group->stopped[i]) {
+                // Runs that stopped leave an empty line in the file
+                Context laneContext = {0};
+                report_lane_error(&laneContext, lane);
+                printf(" %5i:\tError in line %i: %s\n", count,
+                        laneContext.errors[0].line + 1, laneContext.errors[0].message);
+                if (outputFile) {
+                    output_byte(&out, '\n');
+                }
+            } else if (outputFile) {
+                stream_result(&out, lane, format);
+                if (format != DecimalFormat) {
+                    output_byte(&out, '\n');
+                }
+            } else {
+                read_result(lane, result);
+                printf(" %5i:\t%s\n", count, result);
+            }
+        }
+    }
+
+    if (outputFile) {
+        flush_output(&out);
+        if (out.failed) {
+            error(context, "output file could not be written", FILE_ERROR);
+        }
+        free(out.buffer);
+        close(out.fd);
+    }
+    free(lane);
+    free(group);
+    free_batch(program);
+    free(inputs);
+    return out.written;
+}
+
+/*
+ * Here we define the live view used by '--watch'. The machine runs at
+ * full speed and every so often publishes a small snapshot of its state
+ * into a buffer protected by a sequence lock. A separate thread reads
+ * the latest snapshot and draws it to the terminal at a fixed rate, so
+ * the machine never waits for the terminal.
+ */
+typedef struct Snapshot {
+    long long passCount;
+    int configuration;
+    int pointer;
+    int windowStart;
+    char window[WATCH_WINDOW];
+} Snapshot;
+
+typedef struct Watch {
+    // Odd while the snapshot is being written
+    unsigned sequence;
+    Snapshot snapshot;
+    bool finished;
+} Watch;
+
+void publish_snapshot(Watch *watch, Machine *m, long long passCount) {
+    unsigned sequence = watch->sequence;
+    __atomic_store_n(&watch->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    Snapshot *snapshot = &watch->snapshot;
+    snapshot->passCount = passCount;
+    snapshot->configuration = m->configuration;
+    snapshot->pointer = m->pointer;
+    int start = m->pointer - WATCH_WINDOW / 2;
+    if (start > TAPE_LENGTH - WATCH_WINDOW) {
+        start = TAPE_LENGTH - WATCH_WINDOW;
+    }
+    if (start < 0) {
+        start = 0;
+    }
+    snapshot->windowStart = start;
+    memcpy(snapshot->window, &m->tape[start], WATCH_WINDOW);
+
+    __atomic_store_n(&watch->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+void read_snapshot(Watch *watch, Snapshot *snapshot) {
+    while (true) {
+        unsigned before = __atomic_load_n(&watch->sequence, __ATOMIC_ACQUIRE);
+        if (before % 2 == 0) {
+            memcpy(snapshot, &watch->snapshot, sizeof(Snapshot));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&watch->sequence, __ATOMIC_RELAXED) == before) {
+                return;
+            }
+        }
+    }
+}
+
+void run_machine_watched(Context *context, Machine *m, int iterations,
+        char *result, Watch *watch) {
+    long long passCount = 0;
+    publish_snapshot(watch, m, passCount);
+    while (iterations > 0) {
+        // Run a batch of passes between each snapshot
+        int batch = iterations < WATCH_PUBLISH_INTERVAL ? iterations : WATCH_PUBLISH_INTERVAL;
+        for (int i = 0; i < batch; i++) {
+            if (!step_machine(context, m)) {
+                publish_snapshot(watch, m, passCount + i);
+                return;
+            }
+        }
+        iterations -= batch;
+        passCount += batch;
+        publish_snapshot(watch, m, passCount);
+    }
+    read_result(m, result);
+}
+
+#if !defined(_WIN32)
+typedef struct Viewer {
+    Watch *watch;
+    Machine *m;
+} Viewer;
+
+void draw_snapshot(Snapshot *snapshot, Machine *m, double passesPerSecond) {
+    char window[WATCH_WINDOW + 1];
+    char pointer[WATCH_WINDOW + 2];
+    memcpy(window, snapshot->window, WATCH_WINDOW);
+    window[WATCH_WINDOW] = '\0';
+
+    int marker = snapshot->pointer - snapshot->windowStart + 1;
+    if (marker < 0 || marker > WATCH_WINDOW) {
+        marker = 0;
+    }
+    memset(pointer, ' ', marker);
+    pointer[marker] = 'v';
+    pointer[marker + 1] = '\0';
+
+    char *name = m->configurations[snapshot->configuration].info->name;
+    fprintf(stderr, "\033[K Pass %lld (%0.0f passes/sec)\n\033[K  %s\n\033[K  %s\n\033[K  [%s]\n",
+            snapshot->passCount, passesPerSecond, name, pointer, window);
+}
+
+void *run_viewer(void *argument) {
+    Viewer *viewer = (Viewer *)argument;
+    Snapshot snapshot;
+    long long lastPassCount = 0;
+    double lastTime = now_seconds();
+    bool first = true;
+
+    struct timespec frame = {0, 1000000000L / WATCH_FPS};
+    while (true) {
+        bool finished = __atomic_load_n(&viewer->watch->finished, __ATOMIC_ACQUIRE);
+        read_snapshot(viewer->watch, &snapshot);
+
+        double time = now_seconds();
+        double passesPerSecond = 0;
+        if (time > lastTime) {
+            passesPerSecond = (snapshot.passCount - lastPassCount) / (time - lastTime);
+        }
+        lastPassCount = snapshot.passCount;
+        lastTime = time;
+
+        // Move back up and draw over the previous frame
+        if (!first) {
+            fprintf(stderr, "\033[4A");
+        }
+        draw_snapshot(&snapshot, viewer->m, passesPerSecond);
+        first = false;
+
+        if (finished) {
+            return NULL;
+        }
+        nanosleep(&frame, NULL);
+    }
+}
+#endif
+
+// Runs the machine while a separate thread draws it to the terminal
+void run_machine_live(Context *context, Machine *m, int iterations,
+        char *result) {
+#if defined(_WIN32)
+    error(context, "--watch is not supported on windows", ARGUMENT_ERROR);
+#else
+    Watch *watch = (Watch *)calloc(1, sizeof(Watch));
+    Viewer viewer = {watch, m};
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, run_viewer, &viewer);
+    run_machine_watched(context, m, iterations, result, watch);
+    __atomic_store_n(&watch->finished, true, __ATOMIC_RELEASE);
+    pthread_join(thread, NULL);
+    free(watch);
+#endif
+}
+
+/*
+ * Here we define hot reloading, used by '--watch-source'. While the
+ * machine runs, the source file is checked for changes every so often.
+ * When it has changed, the new version is parsed on the side, and if it
+ * has no errors, each of its configurations is matched by name with the
+ * one that is running. Only the configurations that differ are copied
+ * over and translated again, so the machine keeps running on the same
+ * tape. Configurations keep their index, and new ones are added at the
+ * end, so the links between configurations stay valid.
+ *
+ * If the configuration the machine is in was removed, the machine is
+ * restarted from the checkpoint saved before the first pass, with the
+ * first configuration of the new version.
+ */
+typedef struct SourceWatch {
+    char *filename;
+    time_t modified;
+    off_t size;
+    uint64_t contentHash;
+    double nextPoll;
+} SourceWatch;
+
+uint64_t hash_source(char *filename) {
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ull;
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL) {
+        return 0;
+    }
+    int c;
+    while ((c = fgetc(file)) != EOF) {
+        hash = (hash ^ (unsigned char)c) * 1099511628211ull;
+    }
+    fclose(file);
+    return hash;
+}
+
+// Returns true if the file looks different from the last time
+bool source_changed(SourceWatch *watch) {
+    struct stat info;
+    if (stat(watch->filename, &info) != 0) {
+        // Editors sometimes replace the file, so it can be briefly missing
+        return false;
+    }
+    bool changed = info.st_mtime != watch->modified || info.st_size != watch->size;
+    watch->modified = info.st_mtime;
+    watch->size = info.st_size;
+
+    // The time is only kept to the second, or worse on some file systems,
+    // so two saves of the same size shortly after each other can look the
+    // same. While the file is that fresh, its contents are compared as well.
+    if (changed || info.st_mtime >= time(NULL) - 2) {
+        uint64_t hash = hash_source(watch->filename);
+        changed = hash != watch->contentHash;
+        watch->contentHash = hash;
+    }
+    return changed;
+}
+
+bool same_operation(IOperation *a, IOperation *b) {
+    if (a->name != b->name) {
+        return false;
+    }
+    if (a->name == 'P') {
+        return strcmp(a->string, b->string) == 0;
+    }
+    return a->number == b->number;
+}
+
+// Compares a configuration of the new version with the running one,
+// where 'map' takes indices of the new version to running indices
+bool same_config(IConfig *next, IR *nextIR, IConfig *running, IR *runningIR,
+        int *map) {
+    if (next->defined != running->defined || next->branchCount != running->branchCount) {
+        return false;
+    }
+    for (int bi = 0; bi < next->branchCount; bi++) {
+        IBranch *a = &next->branches[bi];
+        IBranch *b = &running->branches[bi];
+        if (strcmp(a->matchSymbol, b->matchSymbol) != 0 || a->opCount != b->opCount ||
+                map[a->next - nextIR->configs] != b->next - runningIR->configs) {
+            return false;
+        }
+        for (int oi = 0; oi < a->opCount; oi++) {
+            if (!same_operation(&a->ops[oi], &b->ops[oi])) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Copies a configuration of the new version over a running one,
+// pointing its branches at the running indices
+void patch_config(IConfig *next, IR *nextIR, IConfig *running, IR *runningIR,
+        int *map) {
+    *running = *next;
+    for (int bi = 0; bi < running->branchCount; bi++) {
+        IBranch *branch = &running->branches[bi];
+        branch->next = &runningIR->configs[map[branch->next - nextIR->configs]];
+    }
+}
+
+typedef enum ReloadOutcome { Unchanged, Patched, Restarted, Rejected } ReloadOutcome;
+
+// Parses the new version of the program and patches it into the running
+// one. Returns Rejected, leaving the machine as it was, if the new
+// version has errors.
+ReloadOutcome reload_source(Machine *m, IR *ir, char *filename, int *patched) {
+    Context c = {0};
+    char *code = read_source(&c, filename);
+    IR *next = (IR *)calloc(1, sizeof(IR));
+    if (code != NULL) {
+        parse_program(&c, next, code);
+    }
+
+    int map[MAX_CONF_COUNT];
+    int nextCount = 0;
+    while (nextCount < MAX_CONF_COUNT && next->configs[nextCount].name != NULL) {
+        nextCount++;
+    }
+    int runningCount = ir->configCount;
+    for (int ci = 0; ci < nextCount && c.nextError == 0; ci++) {
+        map[ci] = find_config(ir->configs, next->configs[ci].name);
+        if (map[ci] == NOT_DEFINED) {
+            if (runningCount == MAX_CONF_COUNT) {
+                error(&c, "too many configurations to reload without restarting", FILE_ERROR);
+                break;
+            }
+            map[ci] = runningCount++;
+        }
+    }
 
-    for (int i = 1; i < argc; ++i) {
-        if (is_number(argv[i])) {
-            char *endPtr;
-            timesToRun = strtol(argv[i], &endPtr, 10);
-        } else if (*argv[i] == '-') {
-            if (*(argv[i] + 1) == 'v') {
-                verbose = true;
+    if (code != NULL && nextCount == 0) {
+        error(&c, "the new version has no configurations", FILE_ERROR);
+    }
+    if (print_errors(&c) || code == NULL) {
+        // Everything the new version refers to is left alone, since
+        // the strings of the running version may be shared with it
+        free(next);
+        return Rejected;
+    }
+
+    *patched = 0;
+    bool removed[MAX_CONF_COUNT];
+    for (int ci = 0; ci < runningCount; ci++) {
+        removed[ci] = true;
+    }
+    for (int ci = 0; ci < nextCount; ci++) {
+        IConfig *running = &ir->configs[map[ci]];
+        removed[map[ci]] = false;
+        if (map[ci] < ir->configCount &&
+                same_config(&next->configs[ci], next, running, ir, map)) {
+            // Lines may have moved, even though the text did not change
+            running->definedOn = next->configs[ci].definedOn;
+            for (int bi = 0; bi < running->branchCount; bi++) {
+                running->branches[bi].definedOn = next->configs[ci].branches[bi].definedOn;
+            }
+            continue;
+        }
+        patch_config(&next->configs[ci], next, running, ir, map);
+        translate_config(ir, m, map[ci]);
+        (*patched)++;
+    }
+    for (int ci = 0; ci < runningCount; ci++) {
+        if (removed[ci] && ir->configs[ci].defined) {
+            ir->configs[ci].defined = false;
+            ir->configs[ci].branchCount = 0;
+            translate_config(ir, m, ci);
+            (*patched)++;
+        }
+    }
+    ir->configCount = runningCount;
+    ir->functionCount = next->functionCount;
+    memcpy(ir->functions, next->functions, sizeof(ir->functions));
+
+    // The first configuration of a program is where it starts
+    int start = map[0];
+    free(next);
+    if (!ir->configs[m->configuration].defined) {
+        m->configuration = start;
+        return Restarted;
+    }
+    return (*patched > 0) ? Patched : Unchanged;
+}
+
+int run_machine_reloading(Context *context, Machine *m, IR *ir, char *filename,
+        int iterations, char *result) {
+    SourceWatch watch = {filename, 0, 0, 0, 0};
+    source_changed(&watch);
+
+    // The checkpoint the machine is restarted from
+    char *savedTape = (char *)malloc(TAPE_LENGTH);
+    memcpy(savedTape, m->tape, TAPE_LENGTH);
+    int savedPointer = m->pointer;
+    int savedTop = m->topPointerAccessed;
+
+    int pass = 0;
+    int passesMade = 0;  // Including the ones made before restarting
+    while (pass < iterations) {
+        if ((pass & (RELOAD_POLL_INTERVAL - 1)) == 0 && now_seconds() >= watch.nextPoll) {
+            watch.nextPoll = now_seconds() + RELOAD_POLL_SECONDS;
+            int patched = 0;
+            ReloadOutcome outcome = source_changed(&watch) ?
+                reload_source(m, ir, filename, &patched) : Unchanged;
+            if (outcome == Patched) {
+                printf("\n Reloaded %s at pass %i: %i configuration%s changed\n",
+                        filename, pass, patched, (patched == 1) ? "" : "s");
+            } else if (outcome == Restarted) {
+                printf("\n Reloaded %s at pass %i: the current configuration was removed, restarting\n",
+                        filename, pass);
+                memcpy(m->tape, savedTape, TAPE_LENGTH);
+                m->pointer = savedPointer;
+                m->topPointerAccessed = savedTop;
+                pass = 0;
+            } else if (outcome == Rejected) {
+                printf("\n Could not reload %s at pass %i, still running the previous version\n",
+                        filename, pass);
             }
+            fflush(stdout);
+        }
 
-        } else if (!filename) {
-            filename = argv[i];
+        if (!step_machine(context, m)) {
+            break;
         }
+        pass++;
+        passesMade++;
     }
 
-    if (filename == 0) {
-        error(&c, "no filename specified", FILE_ERROR);
+    free(savedTape);
+    read_result(m, result);
+    return passesMade;
+}
+
+/*
+ * Here we define the differential testing harness used by '--fuzz'.
+ * It generates random, valid programs, runs each of them on every
+ * engine, and compares the final state of the machine with the one
+ * produced by run_machine, which serves as the reference. When a
+ * mismatch is found, the program is shrunk to a minimal program that
+ * still shows the mismatch.
+ */
+typedef struct FuzzBranch {
+    char symbol[8];
+    int opCount;
+    char ops[MAX_FUZZ_OPS][MAX_FUZZ_OP_LENGTH];
+    int next;
+} FuzzBranch;
+
+typedef struct FuzzConfig {
+    int branchCount;
+    FuzzBranch branches[MAX_FUZZ_BRANCHES];
+} FuzzConfig;
+
+typedef struct FuzzProgram {
+    int passes;
+    int configCount;
+    FuzzConfig configs[MAX_FUZZ_CONFIGS];
+} FuzzProgram;
+
+typedef void (*EngineFunction)(Context *context, Machine *m, int iterations,
+        char *result, int option);
+
+typedef struct Engine {
+    char *name;
+    EngineFunction run;
+    int option;
+} Engine;
+
+void run_reference(Context *context, Machine *m, int iterations, char *result,
+        int option) {
+    run_machine(context, m, iterations, result, false);
+}
+
+// Arms watchpoints that can never trigger, so that the checks of the
+// debugging loop are exercised without ever stopping the machine.
+void run_debug(Context *context, Machine *m, int iterations, char *result,
+        int option) {
+    // A pass can only move the head a few hundred cells,
+    // so it never gets this far from the tape.
+    static Breakpoints breakpoints;
+    breakpoints.cellCount = 1;
+    breakpoints.cells[0] = -4 * TAPE_LENGTH;
+    breakpoints.headCount = 1;
+    breakpoints.heads[0] = -4 * TAPE_LENGTH;
+    run_machine_debug(context, m, iterations, result, &breakpoints, NULL);
+}
+
+// Publishes snapshots without anyone reading them
+void run_watch(Context *context, Machine *m, int iterations, char *result,
+        int option) {
+    static Watch watch;
+    run_machine_watched(context, m, iterations, result, &watch);
+}
+
+// Skips whole trips around any loop that is found
+void run_loops(Context *context, Machine *m, int iterations, char *result,
+        int option) {
+    LoopReport report;
+    run_machine_checked(context, m, iterations, result, &report, false);
+}
+
+// Records the run, goes back a few passes one at a time, then further
+// back through a checkpoint, and replays forward to where it was.
+void run_rewind(Context *context, Machine *m, int iterations, char *result,
+        int option) {
+    UndoLog *undo = create_undo_log(option);
+    start_recording(undo, m);
+    for (int i = 0; i < iterations; i++) {
+        if (!head_on_tape(context, m)) {
+            break;
+        }
+        Configuration *config = &m->configurations[m->configuration];
+        Branch *branch = find_branch(config, m->tape[m->pointer]);
+        if (branch == NULL) {
+            no_branch_error(context, config, m->tape[m->pointer]);
+            break;
+        }
+        execute_recorded(m, branch);
     }
 
-    if (timesToRun == -1) {
-        error(&c, "please specify number of passes to make", FILE_ERROR);
+    int passes = undo->stepCount;
+    rewind_machine(undo, m, passes - option / 2 > 0 ? passes - option / 2 : 0);
+    rewind_machine(undo, m, passes / 3);
+    replay_to(undo, m, passes);
+    read_result(m, result);
+    free_undo_log(undo, m);
+}
+
+// Runs the machine in one lane of a batch, next to lanes that start
+// from scrambled tapes and take different paths through the program.
+// With 'option' set, the AVX2 version is used if the CPU has it.
+void run_batch_lane(Context *context, Machine *m, int iterations, char *result,
+        int option) {
+    int lane = 3;
+    BatchProgram *program = compile_batch(m);
+    BatchGroup *group = (BatchGroup *)calloc(1, sizeof(BatchGroup));
+    char symbols[] = {NONE, '0', '1', 'x', '@'};
+    for (int other = 0; other < BATCH_WIDTH; other++) {
+        load_lane(group, other, m);
+        for (int cell = 0; other != lane && cell < TAPE_LENGTH; cell++) {
+            group->tape[cell * BATCH_WIDTH + other] = symbols[(cell * 7 + other) % 5];
+        }
     }
 
-    char *bytecode = read_source(&c, filename);
+    BatchRunner runner = run_batch_scalar;
+#if defined(BATCH_AVX2)
+    if (option && __builtin_cpu_supports("avx2")) {
+        runner = run_batch_avx2;
+    }
+#endif
+    runner(program, group, iterations);
+    unload_lane(group, lane, m);
+    if (group->stopped[lane]) {
+        report_lane_error(context, m);
+    }
+    read_result(m, result);
+    free(group);
+    free_batch(program);
+}
+
+#if !defined(_WIN32)
+// Sends blanks to a stage, yielding after every one of them, so that the
+// stage keeps running into the end of its input
+void *feed_blanks(void *argument) {
+    RingBuffer *ring = (RingBuffer *)argument;
+    for (int i = 0; i < TAPE_LENGTH / 2; i++) {
+        if (!ring_push(ring, NONE)) {
+            break;
+        }
+        sched_yield();
+    }
+    __atomic_store_n(&ring->done, true, __ATOMIC_RELEASE);
+    return NULL;
+}
 
-    IR ir = {0};
+// Runs the machine as the second stage of a pipeline whose first stage
+// only sends blanks. Blanks on squares the machine has not used yet
+// change nothing, so any difference means that the input landed on a
+// square after the machine had written to it.
+void run_piped(Context *context, Machine *m, int iterations, char *result,
+        int option) {
+    RingBuffer *ring = (RingBuffer *)calloc(1, sizeof(RingBuffer));
+    Stage *stage = (Stage *)calloc(1, sizeof(Stage));
+    stage->m = m;
+    stage->passes = iterations;
+    stage->input = ring;
+    stage->reach = furthest_reach(m);
 
-    parse(&c, &ir, bytecode);
-    Machine m = translate(&ir);
+    pthread_t producer;
+    pthread_create(&producer, NULL, feed_blanks, ring);
+    run_stage(stage);
+    pthread_join(producer, NULL);
 
-    char result[TAPE_LENGTH / 2];
-    run_machine(&c, &m, timesToRun, result, verbose);
-    handle_errors(&c);
+    *context = stage->context;
+    strcpy(result, stage->result);
+    free(stage);
+    free(ring);
+}
+#endif
+
+Engine engines[] = {
+    {"reference", run_reference, 0},
+    {"debug", run_debug, 0},
+    {"rewind", run_rewind, 64},
+    {"batch", run_batch_lane, 0},
+    {"batch avx2", run_batch_lane, 1},
+    {"watch", run_watch, 0},
+    {"loops", run_loops, 0},
+#if !defined(_WIN32)
+    {"pipeline", run_piped, 0},
+#endif
+    {"block 1", run_machine_blocked, 1},
+    {"block 2", run_machine_blocked, 2},
+    {"block 3", run_machine_blocked, 3},
+    {"block 8", run_machine_blocked, 8},
+    {"block 32", run_machine_blocked, 32},
+};
+#define ENGINE_COUNT (int)(sizeof(engines) / sizeof(engines[0]))
+
+uint64_t fuzzState;
+
+uint32_t fuzz_random(uint32_t bound) {
+    // xorshift64*
+    fuzzState ^= fuzzState >> 12;
+    fuzzState ^= fuzzState << 25;
+    fuzzState ^= fuzzState >> 27;
+    return (uint32_t)((fuzzState * 2685821657736338717ull) >> 32) % bound;
+}
+
+void generate_program(FuzzProgram *p, int passes) {
+    char symbols[] = "01xyz@uv";
+    char alphabet[sizeof(symbols)];
+    int alphabetSize = 1 + fuzz_random(sizeof(symbols) - 1);
+    int first = fuzz_random(sizeof(symbols) - alphabetSize);
+    memcpy(alphabet, symbols + first, alphabetSize);
+    alphabet[alphabetSize] = '\0';
+
+    memset(p, 0, sizeof(FuzzProgram));
+    p->passes = passes;
+    p->configCount = 1 + fuzz_random(MAX_FUZZ_CONFIGS);
+    for (int ci = 0; ci < p->configCount; ci++) {
+        FuzzConfig *config = &p->configs[ci];
+
+        // Every symbol of the alphabet, 'none' and 'any' may get a
+        // branch, and 'else' may be added at the end. Symbols without a
+        // branch exercise the error path of the engines.
+        char *candidates[MAX_FUZZ_BRANCHES];
+        char singles[sizeof(symbols)][2];
+        int candidateCount = 0;
+        candidates[candidateCount++] = "none";
+        candidates[candidateCount++] = "any";
+        for (int i = 0; i < alphabetSize; i++) {
+            singles[i][0] = alphabet[i];
+            singles[i][1] = '\0';
+            candidates[candidateCount++] = singles[i];
+        }
+        for (int i = 0; i < candidateCount; i++) {
+            if (fuzz_random(3) != 0) {
+                strcpy(config->branches[config->branchCount++].symbol, candidates[i]);
+            }
+        }
+        if (config->branchCount == 0 || fuzz_random(2) == 0) {
+            strcpy(config->branches[config->branchCount++].symbol, "else");
+        }
+
+        for (int bi = 0; bi < config->branchCount; bi++) {
+            FuzzBranch *branch = &config->branches[bi];
+            branch->next = fuzz_random(p->configCount);
+            branch->opCount = 1 + fuzz_random(MAX_FUZZ_OPS);
+            for (int oi = 0; oi < branch->opCount; oi++) {
+                char *op = branch->ops[oi];
+                switch (fuzz_random(8)) {
+                    case 0: {
+                                strcpy(op, "N");
+                            } break;
+                    case 1: {
+                                strcpy(op, "E");
+                            } break;
+                    case 2: {
+                                // Multi-symbol print
+                                int length = 2 + fuzz_random(3);
+                                op[0] = 'P';
+                                for (int i = 1; i <= length; i++) {
+                                    op[i] = alphabet[fuzz_random(alphabetSize)];
+                                }
+                                op[length + 1] = '\0';
+                            } break;
+                    case 3:
+                    case 4: {
+                                sprintf(op, "P%c", alphabet[fuzz_random(alphabetSize)]);
+                            } break;
+                    case 5: {
+                                // Long move
+                                sprintf(op, "%c%i", fuzz_random(2) ? 'R' : 'L',
+                                        2 + fuzz_random(8));
+                            } break;
+                    default: {
+                                 sprintf(op, "%c", fuzz_random(2) ? 'R' : 'L');
+                             }
+                }
+            }
+        }
+    }
+}
+
+// The symbol that the m-function version of a configuration takes as
+// its parameter 'A': the first symbol it matches on, or else one it prints
+char function_symbol(FuzzConfig *config) {
+    for (int bi = 0; bi < config->branchCount; bi++) {
+        if (strlen(config->branches[bi].symbol) == 1) {
+            return config->branches[bi].symbol[0];
+        }
+    }
+    for (int bi = 0; bi < config->branchCount; bi++) {
+        for (int oi = 0; oi < config->branches[bi].opCount; oi++) {
+            char *op = config->branches[bi].ops[oi];
+            if (op[0] == 'P' && strlen(op) == 2) {
+                return op[1];
+            }
+        }
+    }
+    return '0';
+}
+
+// Writes a reference to configuration 'ci'. In the m-function version,
+// every configuration 'cK' is also written as an m-function 'fK(A, C)',
+// where 'A' stands in for one of its symbols and 'C' for the next
+// configuration of its first branch, and it is referenced through a
+// call that makes it behave exactly like 'cK'.
+char *render_reference(char *c, FuzzProgram *p, int ci, bool functions) {
+    if (!functions) {
+        return c + sprintf(c, "c%i", ci);
+    }
+    return c + sprintf(c, "f%i(%c, c%i)", ci, function_symbol(&p->configs[ci]),
+            p->configs[ci].branches[0].next);
+}
+
+char *render_program(FuzzProgram *p, bool functions) {
+    size_t size = 64 + (size_t)p->configCount * MAX_FUZZ_BRANCHES *
+        (MAX_FUZZ_OPS * (MAX_FUZZ_OP_LENGTH + 2) + 32) * 2;
+    char *code = (char *)malloc(size);
+    char *c = code;
+    for (int ci = 0; ci < p->configCount; ci++) {
+        FuzzConfig *config = &p->configs[ci];
+        for (int bi = 0; bi < config->branchCount; bi++) {
+            FuzzBranch *branch = &config->branches[bi];
+            if (bi == 0) {
+                c += sprintf(c, "c%i: ", ci);
+            } else {
+                c += sprintf(c, "    ");
+            }
+            c += sprintf(c, "%s | ", branch->symbol);
+            for (int oi = 0; oi < branch->opCount; oi++) {
+                c += sprintf(c, oi == 0 ? "%s" : ", %s", branch->ops[oi]);
+            }
+            c += sprintf(c, " | ");
+            c = render_reference(c, p, branch->next, functions);
+            c += sprintf(c, "\n");
+        }
+    }
+
+    for (int ci = 0; functions && ci < p->configCount; ci++) {
+        FuzzConfig *config = &p->configs[ci];
+        char symbol = function_symbol(config);
+        for (int bi = 0; bi < config->branchCount; bi++) {
+            FuzzBranch *branch = &config->branches[bi];
+            if (bi == 0) {
+                c += sprintf(c, "f%i(A, C): ", ci);
+            } else {
+                c += sprintf(c, "    ");
+            }
+            bool parameter = strlen(branch->symbol) == 1 && branch->symbol[0] == symbol;
+            c += sprintf(c, "%s | ", parameter ? "A" : branch->symbol);
+            for (int oi = 0; oi < branch->opCount; oi++) {
+                char *op = branch->ops[oi];
+                if (op[0] == 'P' && op[1] == symbol && op[2] == '\0') {
+                    op = "PA";
+                }
+                c += sprintf(c, oi == 0 ? "%s" : ", %s", op);
+            }
+            c += sprintf(c, " | ");
+            if (bi == 0) {
+                c += sprintf(c, "C");
+            } else {
+                c = render_reference(c, p, branch->next, functions);
+            }
+            c += sprintf(c, "\n");
+        }
+    }
+    return code;
+}
+
+// Besides the engines, the m-function version of every program is run
+// on the reference engine and compared with the plain version. It is
+// reported as the engine after the last one.
+#define FUNCTIONS_ENGINE ENGINE_COUNT
+
+typedef struct FuzzState {
+    IR *ir;
+    IR *functionIR;
+    Machine *machines[ENGINE_COUNT + 1];
+    Context contexts[ENGINE_COUNT + 1];
+    char result[TAPE_LENGTH / 2 + 2];
+} FuzzState;
+
+bool same_state(FuzzState *state, int engine, bool compareConfiguration) {
+    Machine *reference = state->machines[0];
+    Machine *m = state->machines[engine];
+    return (!compareConfiguration || m->configuration == reference->configuration) &&
+        m->pointer == reference->pointer &&
+        m->topPointerAccessed == reference->topPointerAccessed &&
+        state->contexts[engine].nextError == state->contexts[0].nextError &&
+        memcmp(m->tape, reference->tape, TAPE_LENGTH) == 0;
+}
+
+// Runs the program on every engine. Returns the index of the first
+// engine whose final state differs from the reference, or -1 if they
+// all agree.
+int fuzz_program(FuzzState *state, FuzzProgram *p) {
+    Context parseContext = {0};
+    char *code = render_program(p, false);
+
+    memset(state->ir, 0, sizeof(IR));
+    parse(&parseContext, state->ir, code);
+
+    int mismatch = -1;
+    for (int ei = 0; ei < ENGINE_COUNT; ei++) {
+        Machine *m = state->machines[ei];
+        Context *c = &state->contexts[ei];
+        memset(c, 0, sizeof(Context));
+        translate(state->ir, m);
+        engines[ei].run(c, m, p->passes, state->result, engines[ei].option);
+        if (ei > 0 && mismatch == -1 && !same_state(state, ei, true)) {
+            mismatch = ei;
+        }
+    }
+    free(code);
+
+    // The configurations are numbered differently once m-functions
+    // are expanded, so only the tape, head and errors are compared
+    Context *c = &state->contexts[FUNCTIONS_ENGINE];
+    memset(c, 0, sizeof(Context));
+    memset(state->functionIR, 0, sizeof(IR));
+    code = render_program(p, true);
+    parse(c, state->functionIR, code);
+    translate(state->functionIR, state->machines[FUNCTIONS_ENGINE]);
+    run_machine(c, state->machines[FUNCTIONS_ENGINE], p->passes, state->result, false);
+    if (mismatch == -1 && !same_state(state, FUNCTIONS_ENGINE, false)) {
+        mismatch = FUNCTIONS_ENGINE;
+    }
+    free(code);
+    return mismatch;
+}
+
+void remove_config(FuzzProgram *p, int index) {
+    for (int ci = index; ci < p->configCount - 1; ci++) {
+        p->configs[ci] = p->configs[ci + 1];
+    }
+    p->configCount--;
+    for (int ci = 0; ci < p->configCount; ci++) {
+        FuzzConfig *config = &p->configs[ci];
+        for (int bi = 0; bi < config->branchCount; bi++) {
+            int *next = &config->branches[bi].next;
+            if (*next == index) {
+                *next = 0;
+            } else if (*next > index) {
+                (*next)--;
+            }
+        }
+    }
+}
+
+// Greedily removes passes, configurations, branches and operations
+// from the program for as long as the mismatch remains.
+void shrink_program(FuzzState *state, FuzzProgram *p) {
+    FuzzProgram *candidate = (FuzzProgram *)malloc(sizeof(FuzzProgram));
+
+    int low = 0;
+    int high = p->passes;
+    while (low + 1 < high) {
+        int middle = low + (high - low) / 2;
+        *candidate = *p;
+        candidate->passes = middle;
+        if (fuzz_program(state, candidate) != -1) {
+            high = middle;
+        } else {
+            low = middle;
+        }
+    }
+    p->passes = high;
+
+    bool shrunk = true;
+    while (shrunk) {
+        shrunk = false;
+        for (int ci = p->configCount - 1; ci > 0; ci--) {
+            *candidate = *p;
+            remove_config(candidate, ci);
+            if (fuzz_program(state, candidate) != -1) {
+                *p = *candidate;
+                shrunk = true;
+            }
+        }
+        for (int ci = 0; ci < p->configCount; ci++) {
+            for (int bi = p->configs[ci].branchCount - 1; bi >= 0; bi--) {
+                FuzzConfig *config = &candidate->configs[ci];
+                *candidate = *p;
+                if (config->branchCount == 1) {
+                    break;
+                }
+                for (int i = bi; i < config->branchCount - 1; i++) {
+                    config->branches[i] = config->branches[i + 1];
+                }
+                config->branchCount--;
+                if (fuzz_program(state, candidate) != -1) {
+                    *p = *candidate;
+                    shrunk = true;
+                }
+            }
+            for (int bi = 0; bi < p->configs[ci].branchCount; bi++) {
+                for (int oi = p->configs[ci].branches[bi].opCount - 1; oi >= 0; oi--) {
+                    FuzzBranch *branch = &candidate->configs[ci].branches[bi];
+                    *candidate = *p;
+                    if (branch->opCount == 1) {
+                        break;
+                    }
+                    for (int i = oi; i < branch->opCount - 1; i++) {
+                        strcpy(branch->ops[i], branch->ops[i + 1]);
+                    }
+                    branch->opCount--;
+                    if (fuzz_program(state, candidate) != -1) {
+                        *p = *candidate;
+                        shrunk = true;
+                    }
+                }
+            }
+        }
+    }
+    free(candidate);
+}
+
+void report_mismatch(FuzzState *state, FuzzProgram *p, int engine) {
+    Machine *reference = state->machines[0];
+    Machine *m = state->machines[engine];
+
+    bool functions = engine == FUNCTIONS_ENGINE;
+    char *code = render_program(p, functions);
+    printf("\n Mismatch between 'reference' and '%s' after %i passes:\n\n%s\n",
+            functions ? "m-functions" : engines[engine].name, p->passes, code);
+    free(code);
 
+    printf(" Configuration:\t%i vs %i\n", reference->configuration, m->configuration);
+    printf(" Head:\t\t%i vs %i\n", reference->pointer, m->pointer);
+    printf(" Top accessed:\t%i vs %i\n", reference->topPointerAccessed,
+            m->topPointerAccessed);
+    printf(" Errors:\t%i vs %i\n", state->contexts[0].nextError,
+            state->contexts[engine].nextError);
+    for (int i = 0; i < TAPE_LENGTH; i++) {
+        if (reference->tape[i] != m->tape[i]) {
+            printf(" Tape:\t\tcell %i is '%c' vs '%c'\n", i, reference->tape[i],
+                    m->tape[i]);
+            break;
+        }
+    }
+}
+
+// Returns the number of programs that showed a mismatch
+int run_fuzzer(int programs, int passes, uint64_t seed) {
+    FuzzState *state = (FuzzState *)calloc(1, sizeof(FuzzState));
+    state->ir = (IR *)calloc(1, sizeof(IR));
+    state->functionIR = (IR *)calloc(1, sizeof(IR));
+    for (int ei = 0; ei <= ENGINE_COUNT; ei++) {
+        state->machines[ei] = (Machine *)malloc(sizeof(Machine));
+    }
+    FuzzProgram *p = (FuzzProgram *)malloc(sizeof(FuzzProgram));
+
+    fuzzState = seed * 0x9e3779b97f4a7c15ull + 1;
+    int mismatches = 0;
+    for (int i = 0; i < programs; i++) {
+        generate_program(p, passes);
+        int engine = fuzz_program(state, p);
+        if (engine != -1) {
+            mismatches++;
+            shrink_program(state, p);
+            // A mismatch that depends on timing may not show up again
+            int shrunk = fuzz_program(state, p);
+            if (shrunk != -1) {
+                engine = shrunk;
+            }
+            report_mismatch(state, p, engine);
+        }
+    }
+
+    printf("\n Fuzzed %i programs for %i passes on %i engines (seed %llu): %i mismatches\n",
+            programs, passes, ENGINE_COUNT, (unsigned long long)seed, mismatches);
+
+    for (int ei = 0; ei <= ENGINE_COUNT; ei++) {
+        free(state->machines[ei]);
+    }
+    free(state->ir);
+    free(state->functionIR);
+    free(state);
+    free(p);
+    return mismatches;
+}
+
+// Prints interpretations of the result
+void print_result(char *result) {
     // Skip the '@'s in the tape during parsing of values
     int resultBegin = 0;
-    for (int i; i < TAPE_LENGTH; i++) {
+    for (int i = 0; i < TAPE_LENGTH / 2; i++) {
         if (result[i] == '@') {
             resultBegin++;
         } else {
@@ -895,14 +4003,258 @@ int main(int argc, char *argv[]) {
 
     char *normalizedResult = &result[resultBegin];
 
-    char stringResult[256];
+    char stringResult[TAPE_LENGTH / 16 + 2];
     parse_string(stringResult, normalizedResult);
 
     float floatResult = parse_binary_point_value(normalizedResult);
 
-    // Prints interpretations of the result
     printf("\n Binary:\t%s\n String:\t%s\n Float: \t%0.7f\n", result, stringResult,
             floatResult);
+}
+
+int main(int argc, char *argv[]) {
+    Context c = {0};
+
+    int timesToRun = -1;
+    char *filename = 0;
+    char *filenames[MAX_STAGE_COUNT];
+    int filenameCount = 0;
+    bool pipeline = false;
+    Breakpoints *breakpoints = (Breakpoints *)calloc(1, sizeof(Breakpoints));
+    bool verbose = false;
+    bool perf = false;
+    bool watch = false;
+    bool detectLoops = false;
+    bool record = false;
+    char *batchFile = 0;
+    bool watchSource = false;
+    LoopReport loopReport = {0};
+    int blockSize = 0;
+    int fuzzPrograms = 0;
+    uint64_t fuzzSeed = 1;
+    char *outputFile = 0;
+    OutputFormat outputFormat = BinaryFormat;
+    bool useMmap = false;
+
+    for (int i = 1; i < argc; ++i) {
+        if (is_number(argv[i])) {
+            char *endPtr;
+            timesToRun = strtol(argv[i], &endPtr, 10);
+        } else if (*argv[i] == '-') {
+            if (strcmp(argv[i], "--block") == 0) {
+                blockSize = DEFAULT_BLOCK_SIZE;
+                if (i + 1 < argc && is_number(argv[i + 1])) {
+                    blockSize = atoi(argv[++i]);
+                }
+                if (blockSize < 1 || blockSize > MAX_BLOCK_SIZE) {
+                    error(&c, "block size must be between 1 and 32", ARGUMENT_ERROR);
+                }
+            } else if (strcmp(argv[i], "--fuzz") == 0) {
+                fuzzPrograms = DEFAULT_FUZZ_PROGRAMS;
+                if (i + 1 < argc && is_number(argv[i + 1])) {
+                    fuzzPrograms = atoi(argv[++i]);
+                }
+            } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+                fuzzSeed = strtoull(argv[++i], NULL, 10);
+            } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+                batchFile = argv[++i];
+            } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+                outputFile = argv[++i];
+            } else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+                char *format = argv[++i];
+                if (strcmp(format, "binary") == 0) {
+                    outputFormat = BinaryFormat;
+                } else if (strcmp(format, "bytes") == 0) {
+                    outputFormat = BytesFormat;
+                } else if (strcmp(format, "decimal") == 0) {
+                    outputFormat = DecimalFormat;
+                } else {
+                    error(&c, "format must be one of 'binary', 'bytes' or 'decimal'",
+                            ARGUMENT_ERROR);
+                }
+            } else if (strcmp(argv[i], "--break") == 0 && i + 1 < argc) {
+                i++;
+                if (breakpoints->configNameCount == MAX_BREAKPOINT_COUNT) {
+                    error(&c, "too many breakpoints on configurations", ARGUMENT_ERROR);
+                } else {
+                    breakpoints->configNames[breakpoints->configNameCount++] = argv[i];
+                }
+            } else if (strcmp(argv[i], "--break-line") == 0 && i + 1 < argc) {
+                i++;
+                if (breakpoints->lineCount == MAX_BREAKPOINT_COUNT) {
+                    error(&c, "too many breakpoints on lines", ARGUMENT_ERROR);
+                } else {
+                    breakpoints->lines[breakpoints->lineCount++] = atoi(argv[i]);
+                }
+            } else if (strcmp(argv[i], "--watch-cell") == 0 && i + 1 < argc) {
+                i++;
+                if (breakpoints->cellCount == MAX_BREAKPOINT_COUNT) {
+                    error(&c, "too many watchpoints on cells", ARGUMENT_ERROR);
+                } else {
+                    breakpoints->cells[breakpoints->cellCount++] = atoi(argv[i]);
+                }
+            } else if (strcmp(argv[i], "--break-head") == 0 && i + 1 < argc) {
+                i++;
+                if (breakpoints->headCount == MAX_BREAKPOINT_COUNT) {
+                    error(&c, "too many breakpoints on the head", ARGUMENT_ERROR);
+                } else {
+                    breakpoints->heads[breakpoints->headCount++] = atoi(argv[i]);
+                }
+            } else if (strcmp(argv[i], "--pipeline") == 0) {
+                pipeline = true;
+            } else if (strcmp(argv[i], "--mmap") == 0) {
+                useMmap = true;
+            } else if (strcmp(argv[i], "--record") == 0) {
+                record = true;
+            } else if (strcmp(argv[i], "--detect-loops") == 0) {
+                detectLoops = true;
+            } else if (strcmp(argv[i], "--watch-source") == 0) {
+                watchSource = true;
+            } else if (strcmp(argv[i], "--watch") == 0) {
+                watch = true;
+            } else if (strcmp(argv[i], "--perf") == 0) {
+                perf = true;
+            } else if (*(argv[i] + 1) == 'v') {
+                verbose = true;
+            }
+
+        } else if (filenameCount < MAX_STAGE_COUNT) {
+            filenames[filenameCount++] = argv[i];
+            if (!filename) {
+                filename = argv[i];
+            }
+        } else {
+            error(&c, "too many files were given", ARGUMENT_ERROR);
+        }
+    }
+
+    // Each of these runs the machine on its own engine, so rather than
+    // quietly dropping all but one of them, combinations are refused
+    bool anyBreakpoints = breakpoints->configNameCount > 0 || breakpoints->lineCount > 0 ||
+        breakpoints->cellCount > 0 || breakpoints->headCount > 0;
+    bool engineFlags[] = {anyBreakpoints || record, watch, watchSource, detectLoops,
+        blockSize > 0, verbose, batchFile != 0, pipeline};
+    int engineCount = 0;
+    for (int i = 0; i < (int)(sizeof(engineFlags) / sizeof(engineFlags[0])); i++) {
+        engineCount += engineFlags[i];
+    }
+    if (engineCount > 1) {
+        error(&c, "only one of breakpoints or --record, --watch, --watch-source, "
+                "--detect-loops, --block, --batch, --pipeline and -v can be used at a time",
+                ARGUMENT_ERROR);
+    }
+    if (perf && (batchFile || pipeline)) {
+        error(&c, "--perf cannot be combined with --batch or --pipeline", ARGUMENT_ERROR);
+    }
+    // Batches write one line for every input
+    if (batchFile && (useMmap || outputFormat == BytesFormat)) {
+        error(&c, "--batch cannot be combined with --mmap or --format bytes", ARGUMENT_ERROR);
+    }
+
+    if (fuzzPrograms > 0) {
+        if (timesToRun == -1) {
+            timesToRun = DEFAULT_FUZZ_PASSES;
+        }
+        int mismatches = run_fuzzer(fuzzPrograms, timesToRun, fuzzSeed);
+        return mismatches == 0 ? 0 : EXIT_FAILURE;
+    }
+
+    if (filename == 0) {
+        error(&c, "no filename specified", FILE_ERROR);
+    }
+
+    if (timesToRun == -1) {
+        error(&c, "please specify number of passes to make", FILE_ERROR);
+    }
+    handle_errors(&c);
+
+    if (pipeline) {
+        char result[TAPE_LENGTH / 2 + 2];
+        Machine *last = (Machine *)malloc(sizeof(Machine));
+        run_pipeline(&c, filenames, filenameCount, timesToRun, result, last);
+        handle_errors(&c);
+        if (outputFile) {
+            size_t written = write_output(&c, last, outputFile, outputFormat, useMmap);
+            handle_errors(&c);
+            printf("\n Output:\t%lu bytes written to %s\n", (unsigned long)written,
+                    outputFile);
+        } else {
+            print_result(result);
+        }
+        return 0;
+    }
+
+    double parseStart = now_seconds();
+    char *bytecode = read_source(&c, filename);
+
+    // The tables are too large to comfortably keep on the stack
+    IR *ir = (IR *)calloc(1, sizeof(IR));
+    Machine *m = (Machine *)malloc(sizeof(Machine));
+
+    parse(&c, ir, bytecode);
+    double translateStart = now_seconds();
+    translate(ir, m);
+    arm_breakpoints(&c, breakpoints, ir);
+    handle_errors(&c);
+
+    if (batchFile) {
+        size_t written = run_batch(&c, m, batchFile, timesToRun, outputFile, outputFormat);
+        handle_errors(&c);
+        if (outputFile) {
+            printf("\n Output:\t%lu bytes written to %s\n", (unsigned long)written,
+                    outputFile);
+        }
+        return 0;
+    }
+
+    PerfCounters counters;
+    if (perf) {
+        start_perf_counters(&counters);
+    }
+    double runStart = now_seconds();
+
+    // Some engines can stop before all passes have been made
+    int passesMade = timesToRun;
+    char result[TAPE_LENGTH / 2 + 2];
+    if (breakpoints->armed || record) {
+        UndoLog *undo = record ? create_undo_log(CHECKPOINT_INTERVAL) : NULL;
+        passesMade = run_machine_debug(&c, m, timesToRun, result, breakpoints, undo);
+    } else if (watch) {
+        run_machine_live(&c, m, timesToRun, result);
+    } else if (watchSource) {
+        passesMade = run_machine_reloading(&c, m, ir, filename, timesToRun, result);
+    } else if (detectLoops) {
+        run_machine_checked(&c, m, timesToRun, result, &loopReport, true);
+        if (loopReport.found) {
+            passesMade = (int)loopReport.pass;
+        }
+    } else if (blockSize > 0) {
+        run_machine_blocked(&c, m, timesToRun, result, blockSize);
+    } else {
+        run_machine(&c, m, timesToRun, result, verbose);
+    }
+
+    double runEnd = now_seconds();
+    if (perf) {
+        stop_perf_counters(&counters);
+    }
+    handle_errors(&c);
+
+    if (outputFile) {
+        size_t written = write_output(&c, m, outputFile, outputFormat, useMmap);
+        handle_errors(&c);
+        printf("\n Output:\t%lu bytes written to %s\n", (unsigned long)written,
+                outputFile);
+    } else {
+        print_result(result);
+    }
+
+    print_loop_report(&loopReport, ir);
+
+    if (perf) {
+        print_perf_report(translateStart - parseStart, runStart - translateStart,
+                runEnd - runStart, passesMade, &counters);
+    }
 
     return 0;
 }
@@ -13,9 +13,11 @@ typedef struct IR IR;
 
 typedef struct Error Error;
 typedef struct Context Context;
+typedef struct UndoLog UndoLog;
 
 IR *parse(Context *context, IR *ir, char *bytecode);
-Machine translate(IR *ir);
+Machine *translate(IR *ir, Machine *m);
 void run_machine(Context *context, Machine *m, int iterations, char *result, bool verbose);
+void run_machine_blocked(Context *context, Machine *m, int iterations, char *result, int blockSize);
 
 #endif